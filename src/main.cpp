@@ -4,31 +4,96 @@
 #include <cmath>
 #include <ctime>
 #include <algorithm>
-#include <unordered_map>
+#include <numeric>
+#include <cstdlib>
+#include <new>
+#include <chrono>
+#include <cstring>
 #include "glad/glad.h"
 #include <GLFW/glfw3.h>
+#ifdef HEADLESS_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
 #include "imgui/imgui.h"
 #include "imgui/imgui_impl_glfw.h"
 #include "imgui/imgui_impl_opengl3.h"
+#include "nn/layers.h"
+#include "nn/dispatch.h"
+#include "nn/graph.h"
+#include "nn/plan.h"
+#include "nn/structured.h"
+#include "nn/dataset.h"
+#include "nn/rng.h"
 
 // Hyperparameters
 // const int NODES_PER_LAYER[] = {784, 6, 4, 6, 10};
 const int NODES_PER_LAYER[] = {4, 3, 4, 2, 3};
 const float LEARNING_RATE = 0.01;
+enum optimizerType { OPTIMIZER_SGD, OPTIMIZER_MOMENTUM, OPTIMIZER_ADAM };
+const char* const OPTIMIZER_NAMES[] = {"OPTIMIZER_SGD", "OPTIMIZER_MOMENTUM", "OPTIMIZER_ADAM"};
+const optimizerType OPTIMIZER = OPTIMIZER_ADAM; // Update rule of optimizer.comp
+const float MOMENTUM = 0.9f; // Decay of the velocity (OPTIMIZER_MOMENTUM)
+const float ADAM_BETA1 = 0.9f, ADAM_BETA2 = 0.999f, ADAM_EPSILON = 1e-8f; // Decays of the moments & denominator guard (OPTIMIZER_ADAM)
 const int MAX_ITERATIONS = 500;
+const int BATCH_SIZE = 32; // Samples per training step, all of them go through a layer in one dispatch
+const float DROPOUT_RATE = 0.f; // Probability of dropping a hidden neuron while training, worth raising for the 784 input model
+const unsigned long long SEED = 0; // Keys every random sequence, 0 picks a time based seed
+const float PRUNE_FRACTION = 0.25f; // Fraction of every hidden layer's neurons the "Prune neurons" button removes
+const int PRUNE_CALIBRATION_SAMPLES = 256; // Samples the neurons are scored on
+const float WEIGHT_PRUNE_FRACTION = 0.5f; // Fraction of every hidden dense layer's remaining weights the "Prune weights" button zeroes
+const unsigned long long HEADLESS_STEPS = 100000; // Training steps of a headless run (--headless)
+const double TRAINING_FRAME_BUDGET = 0.012; // Seconds of every frame spent training, the rest is left to the UI
+const int TRAINING_CHUNK_STEPS = 32; // Steps submitted between two waits on the GPU, bounds how far the budget can overshoot
+const int INPUT_RING_SLOTS = 3; // Batches in flight in the input ring, the CPU fills one while the GPU trains on the others
+const size_t DEVICE_DATASET_MAX_BYTES = 256u << 20; // Datasets up to this size are uploaded once & batched on the GPU, 0 always batches on the CPU
+// Tiles of dense_tiled.comp: TILE_M samples x TILE_N neurons per workgroup, TILE_K inputs staged at a time, MICRO_M x MICRO_N outputs per invocation
+const int DENSE_TILE_M = 32, DENSE_TILE_N = 64, DENSE_TILE_K = 16, DENSE_MICRO_M = 4, DENSE_MICRO_N = 4;
+const int DENSE_TILED_MIN_SOURCES = 64; // Dense layers with at least this many inputs use the tiled shader, smaller ones can't fill a tile
+const int FUSED_MAX_NEURONS = 2048; // Networks up to this many neurons per sample run forward in one dispatch (8KB of shared memory, 32KB are guaranteed), 0 disables it
+const int FUSED_THREADS = 32; // Invocations per sample of the single dispatch forward pass
 
 const char* DATA_FILENAME = "./data/iris/iris.data"; // Path to the dataset
 
+#ifdef _DEBUG
+// Counts heap allocations so the training step can be checked to stay allocation free
+static size_t _allocations = 0;
+void* operator new(size_t size){
+    _allocations++;
+    if(void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+#endif
+
+// Programs the shaders are linked into, every compute shader needs a program of its own
+enum module { RENDER_MODULE, BATCH_INPUT_MODULE, DATASET_GATHER_MODULE, FEEDFORWARD_MODULE, DENSE_TILED_MODULE, NETWORK_FUSED_MODULE, LOSS_MODULE, BACKPROP_MODULE, OPTIMIZER_MODULE, N_MODULES };
+const char* MODULE_NAMES[N_MODULES] = {"RENDER", "BATCH_INPUT", "DATASET_GATHER", "FEEDFORWARD", "DENSE_TILED", "NETWORK_FUSED", "LOSS", "BACKPROP", "OPTIMIZER"};
+
+// Stages of backprop.comp, dispatched in this order for every layer (keep in sync with the shader's STAGE_ constants)
+enum backpropStage { BACKPROP_EPILOGUE, BACKPROP_PROPAGATE, BACKPROP_GRADIENTS, N_BACKPROP_STAGES };
+// Dispatch parameter records per layer, one per stage of the shader with the most
+const int N_DISPATCH_STAGES = N_BACKPROP_STAGES;
+
 struct shader
 {
     const char* sourcePath;
     unsigned int type;
+    module program;
 };
 
-const shader SHADERS[] = {{"./shaders/feedforward.comp", GL_COMPUTE_SHADER},
-                        // {"./shaders/backprop.comp", GL_COMPUTE_SHADER},
-                        {"./shaders/frag.glsl", GL_FRAGMENT_SHADER},
-                        {"./shaders/vert.glsl", GL_VERTEX_SHADER}};
+const shader SHADERS[] = {{"./shaders/batch_input.comp", GL_COMPUTE_SHADER, BATCH_INPUT_MODULE},
+                        {"./shaders/dataset_gather.comp", GL_COMPUTE_SHADER, DATASET_GATHER_MODULE},
+                        {"./shaders/feedforward.comp", GL_COMPUTE_SHADER, FEEDFORWARD_MODULE},
+                        {"./shaders/dense_tiled.comp", GL_COMPUTE_SHADER, DENSE_TILED_MODULE},
+                        {"./shaders/network_fused.comp", GL_COMPUTE_SHADER, NETWORK_FUSED_MODULE},
+                        {"./shaders/loss.comp", GL_COMPUTE_SHADER, LOSS_MODULE},
+                        {"./shaders/backprop.comp", GL_COMPUTE_SHADER, BACKPROP_MODULE},
+                        {"./shaders/optimizer.comp", GL_COMPUTE_SHADER, OPTIMIZER_MODULE},
+                        {"./shaders/frag.glsl", GL_FRAGMENT_SHADER, RENDER_MODULE},
+                        {"./shaders/vert.glsl", GL_VERTEX_SHADER, RENDER_MODULE}};
 
 // Vertices for the quad (2 triangles) that we are drawing the visualization on
 const float VERTS[] = {
@@ -66,64 +131,186 @@ float* normalize(const float* arr, int length){
     return normalized;
 }
 
+/// Utility function to get the tile sizes of dense_tiled.comp as defines
+std::string denseTileDefines(){
+    return "#define TILE_M " + std::to_string(DENSE_TILE_M) + "\n#define TILE_N " + std::to_string(DENSE_TILE_N) +
+           "\n#define TILE_K " + std::to_string(DENSE_TILE_K) + "\n#define MICRO_M " + std::to_string(DENSE_MICRO_M) +
+           "\n#define MICRO_N " + std::to_string(DENSE_MICRO_N) + "\n";
+}
 
-struct range{
-    int begin;
-    int end;
-};
+/// Utility function to get the capacity & workgroup size of network_fused.comp as defines
+std::string fusedDefines(){
+    return "#define FUSED_MAX_NEURONS " + std::to_string(FUSED_MAX_NEURONS > 0 ? FUSED_MAX_NEURONS : 1) +
+           "\n#define FUSED_THREADS " + std::to_string(FUSED_THREADS) + "\n";
+}
 
-struct forwardingLayer{
-    range neurons;
-    range weights;
-    range biases;
-    int srcNeurons;   // Neurons in the previous (source) layer
-    int dstNeurons;   // Neurons in the current (destination) layer
-};
+/// Utility function to get the update rule of optimizer.comp as defines
+std::string optimizerDefines(){
+    std::string defines;
+    for(int i=0; i <= OPTIMIZER_ADAM; i++)
+        defines += std::string("#define ") + OPTIMIZER_NAMES[i] + " " + std::to_string(i) + "\n";
+    return defines + "#define OPTIMIZER " + OPTIMIZER_NAMES[OPTIMIZER] + "\n";
+}
 
+/// Utility function to get the floats of optimizer state kept per parameter
+int optimizerStateSlots(optimizerType optimizer){
+    return optimizer == OPTIMIZER_ADAM ? 2 : optimizer == OPTIMIZER_MOMENTUM ? 1 : 0;
+}
 
-int main() {
-    srand(time(nullptr));
+/// Utility function to get the defines a module's shaders are compiled with
+std::string moduleDefines(module program){
+    switch(program){
+        case DENSE_TILED_MODULE: return denseTileDefines();
+        case NETWORK_FUSED_MODULE: return fusedDefines();
+        case OPTIMIZER_MODULE: return optimizerDefines();
+        default: return "";
+    }
+}
 
-    // Initialize library
-    if(!glfwInit())
-    {
-        std::cerr << "GLFW could not start\n";
-        exit(-1);  
+/// Utility function to get the declarations a module's shaders are compiled with, inserted by injectPrelude
+/// type - the shader's stage, only compute shaders read DispatchParams
+std::string modulePrelude(module program, unsigned int type){
+    std::string prelude = moduleDefines(program) + forwardingLayerGLSL();
+    if(type == GL_COMPUTE_SHADER)
+        prelude += dispatchParamsGLSL();
+    // The forward shaders share one epilogue, so they can't disagree with each other or with nn/dense.h
+    if(program == FEEDFORWARD_MODULE || program == DENSE_TILED_MODULE || program == NETWORK_FUSED_MODULE)
+        prelude += forwardEpilogueGLSL();
+    return prelude;
+}
+
+/// Utility function to tell whether the forward pass runs in one dispatch of network_fused.comp
+/// The network has to fit in its shared memory, and have no layer wide enough for the tiled shader,
+/// which reuses the weights across samples where the fused shader reads them again for every sample.
+bool fusedForward(const networkLayout& layout){
+    if(layout.nNeurons > FUSED_MAX_NEURONS)
+        return false;
+    for(const forwardingLayer& layer: layout.layers)
+        if(layer.type == LAYER_DENSE && layer.srcNeurons >= DENSE_TILED_MIN_SOURCES)
+            return false;
+    return true;
+}
+
+/// Utility function to insert shared declarations into a shader's source
+/// source - the shader's source
+/// prelude - the declarations, inserted after the leading directives (#version & #extension have to come first)
+/// returns - the new source, with a #line directive so compiler errors still point at the original lines
+std::string injectPrelude(const std::string& source, const std::string& prelude){
+    size_t pos = 0;
+    int line = 1;
+    while(pos < source.size() && source[pos] == '#'){
+        size_t next = source.find('\n', pos);
+        if(next == std::string::npos)
+            return source + "\n" + prelude;
+        pos = next + 1;
+        line++;
     }
+    return source.substr(0, pos) + prelude + "#line " + std::to_string(line) + "\n" + source.substr(pos);
+}
+
+#ifdef HEADLESS_EGL
+/// Creates a GL 4.6 core context with no surface at all (EGL_KHR_surfaceless_context, e.g. Mesa llvmpipe) & makes it current
+/// display - output, has to be terminated once done
+/// returns - false if no such context could be created (the reason is printed)
+bool createSurfacelessContext(EGLDisplay& display){
+    // Prefer the surfaceless platform, so no display server is needed at all
+    auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    display = getPlatformDisplay ? getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr) : EGL_NO_DISPLAY;
+    if(display == EGL_NO_DISPLAY)
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if(display == EGL_NO_DISPLAY || !eglInitialize(display, nullptr, nullptr)){
+        std::cerr << "ERROR::EGL_DISPLAY_FAILED\n" << std::hex << eglGetError() << std::dec << std::endl;
+        return false;
+    }
+    const EGLint configAttributes[] = {EGL_SURFACE_TYPE, 0, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE};  // No window bit, nothing is drawn
+    const EGLint contextAttributes[] = {EGL_CONTEXT_MAJOR_VERSION, 4, EGL_CONTEXT_MINOR_VERSION, 6,
+                                        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT, EGL_NONE};
+    EGLConfig config;
+    EGLint nConfigs = 0;
+    EGLContext context = EGL_NO_CONTEXT;
+    if(eglBindAPI(EGL_OPENGL_API) && eglChooseConfig(display, configAttributes, &config, 1, &nConfigs) && nConfigs > 0)
+        context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttributes);
+    if(context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)){
+        std::cerr << "ERROR::EGL_CONTEXT_FAILED\n" << std::hex << eglGetError() << std::dec << std::endl;
+        eglTerminate(display);
+        return false;
+    }
+    return true;
+}
+#endif
 
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 
-    // Instantiate window
-    auto _window = glfwCreateWindow(640, 480, "OpenGL Programming Application", NULL, NULL);
-    if(!_window)
+int main(int argc, char** argv) {
+    // --headless trains without showing anything: no window, ImGui or render program, just the compute shaders
+    const bool _headless = argc > 1 && std::strcmp(argv[1], "--headless") == 0;
+    const uint64_t _seed = SEED ? SEED : (uint64_t)time(nullptr);
+    #ifdef _DEBUG
+        printf("Seed: %llu\n", (unsigned long long)_seed);
+    #endif
+
+    // Headless runs use a surfaceless EGL context when built with -DHEADLESS_EGL, otherwise a hidden GLFW window
+    GLFWwindow* _window = nullptr;
+    GLADloadproc loadProc = (GLADloadproc)glfwGetProcAddress;
+    #ifdef HEADLESS_EGL
+    EGLDisplay _eglDisplay = EGL_NO_DISPLAY;
+    if(_headless){
+        if(!createSurfacelessContext(_eglDisplay))
+            exit(-1);
+        loadProc = (GLADloadproc)eglGetProcAddress;
+    }
+    else
+    #endif
     {
-        std::cerr << "Failed to create window\n";
-        glfwTerminate();
-        exit(-1);
+        // Initialize library
+        if(!glfwInit())
+        {
+            std::cerr << "GLFW could not start\n";
+            exit(-1);  
+        }
+
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+        glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+        if(_headless)
+            glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
+        // Instantiate window
+        _window = glfwCreateWindow(640, 480, "OpenGL Programming Application", NULL, NULL);
+        if(!_window)
+        {
+            std::cerr << "Failed to create window\n";
+            glfwTerminate();
+            exit(-1);
+        }
+        
+        // Make window's context current, has to be before loading glad
+        glfwMakeContextCurrent(_window);
     }
-    
-    // Make window's context current, has to be before loading glad
-    glfwMakeContextCurrent(_window);
 
-    if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress)) {
+    if (!gladLoadGLLoader(loadProc)) {
         std::cerr << "Failed to initialize GLAD\n";
         glfwTerminate();
         exit(-1);
     }
     
-    // Initialize ImGUI
-    IMGUI_CHECKVERSION();
-    ImGui::CreateContext();
-    ImGuiIO& io = ImGui::GetIO();
-    io.ConfigFlags |= ImGuiConfigFlags_NavEnableKeyboard;     // Enable Keyboard Controls
-    //io.ConfigFlags |= ImGuiConfigFlags_NavEnableGamepad;      // Enable Gamepad Controls
+    if(!_headless){
+        // Initialize ImGUI
+        IMGUI_CHECKVERSION();
+        ImGui::CreateContext();
+        ImGuiIO& io = ImGui::GetIO();
+        io.ConfigFlags |= ImGuiConfigFlags_NavEnableKeyboard;     // Enable Keyboard Controls
+        //io.ConfigFlags |= ImGuiConfigFlags_NavEnableGamepad;      // Enable Gamepad Controls
+
+        // Setup Platform/Renderer backends
+        ImGui_ImplGlfw_InitForOpenGL(_window, true);          // Second param install_callback=true will install GLFW callbacks and chain to existing ones.
+        ImGui_ImplOpenGL3_Init();
 
-    // Setup Platform/Renderer backends
-    ImGui_ImplGlfw_InitForOpenGL(_window, true);          // Second param install_callback=true will install GLFW callbacks and chain to existing ones.
-    ImGui_ImplOpenGL3_Init();
+        // Set callback function for when the window size is changed
+        glfwSetFramebufferSizeCallback(_window, [](GLFWwindow* window, int width, int height) {
+            glViewport(0, 0, width, height);
+        });
+    }
 
     #ifdef _DEBUG
         // Check environment
@@ -132,25 +319,22 @@ int main() {
         printf("OpenGL version: %s\n", glGetString(GL_VERSION));
     #endif
 
-
-    // Set callback function for when the window size is changed
-    glfwSetFramebufferSizeCallback(_window, [](GLFWwindow* window, int width, int height) {
-        glViewport(0, 0, width, height);
-    });
-
     // Register shader
-    unsigned int _renderModule, _computeModule;
+    unsigned int _modules[N_MODULES];
     if(true){
-        _renderModule = glCreateProgram();
-        _computeModule = glCreateProgram();
+        for(int m=0; m < N_MODULES; m++)
+            _modules[m] = glCreateProgram();
 
         for(shader sh: SHADERS){
+            if(_headless && sh.program == RENDER_MODULE)
+                continue;
             std::ifstream shaderFile(sh.sourcePath);
             if (!shaderFile.is_open()) {
                 std::cerr << "Failed to open shader file: " << sh.sourcePath << std::endl;
                 continue;
             }
             std::string contents((std::istreambuf_iterator<char>(shaderFile)), std::istreambuf_iterator<char>());
+            contents = injectPrelude(contents, modulePrelude(sh.program, sh.type));
             const char* shaderSource = contents.c_str();
 
             // Compile shader
@@ -169,74 +353,117 @@ int main() {
                     printf("Shader source (%s): \n%s\n", glGetString(sh.type), shaderSource);
                 #endif
             }
-            sh.type == GL_COMPUTE_SHADER ? glAttachShader(_computeModule, shader) : glAttachShader(_renderModule, shader);
+            glAttachShader(_modules[sh.program], shader);
             glDeleteShader(shader);
         }
 
-        glLinkProgram(_computeModule);
-        glLinkProgram(_renderModule);
+        for(int m=0; m < N_MODULES; m++){
+            if(_headless && m == RENDER_MODULE)
+                continue;
+            glLinkProgram(_modules[m]);
 
-        int success;
-        glGetProgramiv(_computeModule, GL_LINK_STATUS, &success);
-        if(!success){
-            char infoLog[512];
-            glGetProgramInfoLog(_computeModule, 512, nullptr, infoLog);
-            std::cerr << "ERROR::COMPUTE_PROGRAM_LINKING_FAILED\n" << infoLog << std::endl;
-        }
-        
-        glGetProgramiv(_renderModule, GL_LINK_STATUS, &success);
-        if(!success){
-            char infoLog[512];
-            glGetProgramInfoLog(_renderModule, 512, nullptr, infoLog);
-            std::cerr << "ERROR::RENDER_PROGRAM_LINKING_FAILED\n" << infoLog << std::endl;
+            int success;
+            glGetProgramiv(_modules[m], GL_LINK_STATUS, &success);
+            if(!success){
+                char infoLog[512];
+                glGetProgramInfoLog(_modules[m], 512, nullptr, infoLog);
+                std::cerr << "ERROR::" << MODULE_NAMES[m] << "_PROGRAM_LINKING_FAILED\n" << infoLog << std::endl;
+            }
         }
     }
+    unsigned int _renderModule = _modules[RENDER_MODULE];
+    unsigned int _batchInputModule = _modules[BATCH_INPUT_MODULE];
+    unsigned int _gatherModule = _modules[DATASET_GATHER_MODULE];
+    unsigned int _computeModule = _modules[FEEDFORWARD_MODULE];
+    unsigned int _denseTiledModule = _modules[DENSE_TILED_MODULE];
+    unsigned int _fusedModule = _modules[NETWORK_FUSED_MODULE];
+    unsigned int _lossModule = _modules[LOSS_MODULE];
+    unsigned int _backpropModule = _modules[BACKPROP_MODULE];
+    unsigned int _optimizerModule = _modules[OPTIMIZER_MODULE];
+    // Render uniforms set after startup, looked up once (-1 when headless, which glUniform ignores)
+    const int _layersCountLocation = _headless ? -1 : glGetUniformLocation(_renderModule, "layersCount");
+    const int _aspectRatioLocation = _headless ? -1 : glGetUniformLocation(_renderModule, "aspectRatio");
 
     // Set renderer Uniforms
     // glUniform1f(glGetUniformLocation(_renderModule, "minValNeurons"), 0.f);
     // glUniform1f(glGetUniformLocation(_renderModule, "maxValNeurons"), 1.f);
     
-    // NN
-    int _nTargets = 0;
-    std::unordered_map<std::string, int> _targets;
-    int _nNeurons = 0, _nWeights = 0, _nBiases = 0;
+    // NN, described as a layer graph then lowered into the flat buffers & the layer table
     int nplLength = sizeof(NODES_PER_LAYER)/sizeof(int);
-    forwardingLayer* _forwardingLayers = new forwardingLayer[nplLength - 1];
-    for(int i=0; i < nplLength; i++){
-        _nNeurons += NODES_PER_LAYER[i];  // Count all the neurons
+    layerGraph _graph;
+    graphInput(_graph, {NODES_PER_LAYER[0], 1, 1});
+    for(int i=1; i < nplLength; i++){
+        graphDense(_graph, NODES_PER_LAYER[i]);
         if(i < nplLength - 1){
-            int srcNeurons = NODES_PER_LAYER[i];
-            int dstNeurons = NODES_PER_LAYER[i+1];
-            int weights = srcNeurons * dstNeurons;
-
-            _forwardingLayers[i] = {
-                {_nNeurons, _nNeurons + dstNeurons},
-                {_nWeights, _nWeights + weights},
-                {_nBiases, _nBiases + dstNeurons},
-                srcNeurons,
-                dstNeurons
-            };
-            _nWeights += weights; // Count all the weights
-            _nBiases += dstNeurons; // Count all the biases
+            graphActivation(_graph, ACT_SOFTPLUS);
+            graphDropout(_graph, DROPOUT_RATE);  // Removed by optimizeGraph when the rate is 0
+        }
+    }
+    graphLoss(_graph);
+
+    optimizeGraph(_graph);
+    networkLayout _layout;
+    if(!lowerGraph(_graph, _layout)){
+        glfwTerminate();
+        exit(-1);
+    }
+    // The shaders only apply a batchnorm layer's frozen running statistics, they neither update them nor train
+    // gamma & beta, so a batchnorm network is trained with the CPU plan (nn/plan.h) instead
+    for(int i=0; i < (int)_layout.layers.size(); i++)
+        if(_layout.layers[i].norm.end > _layout.layers[i].norm.begin){
+            std::cerr << "ERROR::GPU_BATCHNORM_UNSUPPORTED\nlayer " << i << " is batch normalized, GPU training has no "
+                      << "batch statistics or gamma/beta gradients, train it with the CPU plan" << std::endl;
+            glfwTerminate();
+            exit(-1);
         }
+    int _nNeurons = _layout.nNeurons, _nWeights = _layout.nWeights, _nBiases = _layout.nBiases;
+    int _nLayers = (int)_layout.layers.size();
+    forwardingLayer* _forwardingLayers = _layout.layers.data();
+
+    // The whole dataset is parsed up front, a training step only copies a row
+    dataset _data;
+    if(!loadDataset(DATA_FILENAME, _layout.inputNeurons, _data)){
+        glfwTerminate();
+        exit(-1);
+    }
+    // Every label indexes the logits (loss.comp), a class without an output neuron would read past them
+    if((int)_data.classes.size() > _layout.layers[_layout.lossLayer].dstNeurons){
+        std::cerr << "ERROR::DATASET_TOO_MANY_CLASSES\n" << DATA_FILENAME << " has " << _data.classes.size()
+                  << " classes but the output layer has " << _layout.layers[_layout.lossLayer].dstNeurons << " neurons" << std::endl;
+        glfwTerminate();
+        exit(-1);
     }
 
 
     // All layer features will be mapped to a 1D array
     // Features of one layer will be sequential until the nth of the layer,
     // then the next will belong to the following layer
-    float* _neurons = new float[_nNeurons]; 
+    // A training step processes a whole batch, neurons of consecutive samples are _nNeurons apart
+    const int batchSize = BATCH_SIZE;
+    float* _neurons = new float[batchSize * _nNeurons]; 
     float* _weights = new float[_nWeights];
     float* _biases = new float[_nBiases]{0};
+    float* _norms = new float[_layout.nNormParams + 1];
 
     // Arrays for storing the weight and bias gradients
     float* _weightGradients = new float[_nWeights]{0};
     float* _biasGradients = new float[_nBiases]{0};
 
-    // Initialize weights to random values between -5 & 5
-    float minWeight = FLT_MAX, maxWeight = FLT_MIN;
+    // Initialize weights, He for the softplus layers & Xavier for the rest (e.g. the one feeding the softmax)
+    for(int i=0; i < _nLayers; i++){
+        forwardingLayer& layer = _forwardingLayers[i];
+        int fanIn = layer.type == LAYER_CONV ? layer.src.channels * layer.kernel * layer.kernel : layer.srcNeurons;
+        if(layer.weights.end == layer.weights.begin)
+            continue;
+        if(layer.activation == ACT_SOFTPLUS)
+            heInit(_weights + layer.weights.begin, fanIn, layer.dst.channels, _seed, i);
+        else
+            xavierInit(_weights + layer.weights.begin, fanIn, layer.dst.channels, _seed, i);
+        if(layer.norm.end > layer.norm.begin)
+            batchNormInit(_norms + layer.norm.begin, layer.dst.channels);
+    }
+    float minWeight = FLT_MAX, maxWeight = -FLT_MAX;
     for(int i=0; i<_nWeights; i++){
-        _weights[i] = (float) rand() / (float) RAND_MAX * 10.0f - 5.0f;
         if(minWeight > _weights[i])
             minWeight = _weights[i];
         if(maxWeight < _weights[i])
@@ -245,60 +472,227 @@ int main() {
 
     #ifdef _DEBUG
     // Initialize neurons to random values between -5 & 5 (NOT PRACTICAL), only for debugging visualization
-    float minNeuron = FLT_MAX, maxNeuron = FLT_MIN;
+    float minNeuron = FLT_MAX, maxNeuron = -FLT_MAX;
+    rngFillUniform(_neurons, _nNeurons, -5.0f, 5.0f, _seed, RNG_DEBUG, 0);
     for(int i=0; i<_nNeurons; i++){
-        _neurons[i] = (float) rand() / (float) RAND_MAX * 10.0f - 5.0f;
         if(minNeuron > _neurons[i])
             minNeuron = _neurons[i];
         if(maxNeuron < _neurons[i])
             maxNeuron = _neurons[i];
     }
 
-    glUseProgram(_renderModule);
-    glUniform1f(glGetUniformLocation(_renderModule, "minValNeurons"), minNeuron);
-    glUniform1f(glGetUniformLocation(_renderModule, "maxValNeurons"), maxNeuron);
+    if(!_headless){
+        glUseProgram(_renderModule);
+        glUniform1f(glGetUniformLocation(_renderModule, "minValNeurons"), minNeuron);
+        glUniform1f(glGetUniformLocation(_renderModule, "maxValNeurons"), maxNeuron);
+    }
     #endif
 
-    glUseProgram(_renderModule);
-    glUniform1f(glGetUniformLocation(_renderModule, "minValWeights"), minWeight);
-    glUniform1f(glGetUniformLocation(_renderModule, "maxValWeights"), maxWeight);
-    glUniform1i(glGetUniformLocation(_renderModule, "layersCount"), nplLength - 1);
+    if(!_headless){
+        glUseProgram(_renderModule);
+        glUniform1f(glGetUniformLocation(_renderModule, "minValWeights"), minWeight);
+        glUniform1f(glGetUniformLocation(_renderModule, "maxValWeights"), maxWeight);
+        glUniform1i(_layersCountLocation, _nLayers);
+    }
+
+    // Dispatch parameters of the compute programs, one record per (layer, stage) in a uniform buffer,
+    // laid out again whenever the layout changes (pruning). A dispatch only binds its record.
+    int _paramsAlignment = 0;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &_paramsAlignment);
+    const int _paramsStride = dispatchParamsStride(_paramsAlignment);
+    unsigned int _paramsUBO;
+    glGenBuffers(1, &_paramsUBO);
+    bool _fusedForward = false;
+    // The per step fields are left at zero, see the input ring for their records
+    auto layerDispatchParams = [&](int i, int stage){
+        return dispatchParams{i, stage, batchSize, _nNeurons, _layout.maskStride, _nLayers, _layout.lossLayer, _nWeights, _nBiases,
+                              LEARNING_RATE, MOMENTUM, ADAM_BETA1, ADAM_BETA2, ADAM_EPSILON, 0, 0};
+    };
+    auto writeDispatchParams = [&](){
+        _fusedForward = fusedForward(_layout);
+        std::vector<char> records((size_t)_nLayers * N_DISPATCH_STAGES * _paramsStride, 0);
+        for(int i=0; i < _nLayers; i++)
+            for(int stage=0; stage < N_DISPATCH_STAGES; stage++){
+                dispatchParams params = layerDispatchParams(i, stage);
+                std::memcpy(records.data() + (size_t)(i * N_DISPATCH_STAGES + stage) * _paramsStride, &params, sizeof(params));
+            }
+        glBindBuffer(GL_UNIFORM_BUFFER, _paramsUBO);
+        glBufferData(GL_UNIFORM_BUFFER, records.size(), records.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    };
+    writeDispatchParams();
+    // Layer independent dispatches (loss, fused forward) can use any record, e.g. the first one
+    auto bindDispatchParams = [&](int layerIdx, int stage){
+        glBindBufferRange(GL_UNIFORM_BUFFER, DISPATCH_PARAMS_BINDING, _paramsUBO,
+                          (GLintptr)(layerIdx * N_DISPATCH_STAGES + stage) * _paramsStride, sizeof(dispatchParams));
+    };
+    bindDispatchParams(0, 0);
 
 
     // Copy neurons, weights & biases to SSBO
-    const int nBuffers = 6;
+    // Everything is sized from the layout, so it is uploaded again whenever the network changes shape (pruning)
+    const int nBuffers = 13;
     unsigned int _SSBOs[nBuffers];
     glGenBuffers(nBuffers, _SSBOs);
-    // Neurons
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, _SSBOs[0]);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, _nNeurons * sizeof(float), _neurons, GL_DYNAMIC_DRAW);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, _SSBOs[0]);
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
-    // Weights
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, _SSBOs[1]);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, _nWeights * sizeof(float), _weights, GL_DYNAMIC_DRAW);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, _SSBOs[1]);
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
-    // Biases
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, _SSBOs[2]);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, _nBiases * sizeof(float), _biases, GL_DYNAMIC_DRAW);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, _SSBOs[2]);
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
-    // Weight gradients
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, _SSBOs[3]);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, _nWeights * sizeof(float), _weightGradients, GL_DYNAMIC_DRAW);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _SSBOs[3]);
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
-    // Bias gradients
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, _SSBOs[4]);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, _nBiases * sizeof(float), _biasGradients, GL_DYNAMIC_DRAW);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, _SSBOs[4]);
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
-    // Forwarding Layers
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, _SSBOs[5]);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, (nplLength - 1) * sizeof(forwardingLayer), _forwardingLayers, GL_DYNAMIC_DRAW);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, _SSBOs[5]);
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    int _optimizerStep = 0;  // Updates since the optimizer state was reset
+    std::vector<float> _pruneMask;  // [nWeights] 0 for the weights "Prune weights" zeroed
+    bool _weightsPruned = false;
+    auto uploadNetwork = [&](){
+        // Neurons
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _SSBOs[0]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, batchSize * _nNeurons * sizeof(float), _neurons, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, _SSBOs[0]);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        // Weights
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _SSBOs[1]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, _nWeights * sizeof(float), _weights, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, _SSBOs[1]);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        // Biases
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _SSBOs[2]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, _nBiases * sizeof(float), _biases, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, _SSBOs[2]);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        // Weight gradients
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _SSBOs[3]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, _nWeights * sizeof(float), _weightGradients, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _SSBOs[3]);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        // Bias gradients
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _SSBOs[4]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, _nBiases * sizeof(float), _biasGradients, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, _SSBOs[4]);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        // Forwarding Layers
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _SSBOs[5]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, _nLayers * sizeof(forwardingLayer), _forwardingLayers, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, _SSBOs[5]);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        // Deltas (dLoss/dNeuron), same layout as the neurons
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _SSBOs[6]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, batchSize * _nNeurons * sizeof(float), nullptr, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, _SSBOs[6]);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        // Targets (7) are streamed through the input ring
+        // Losses (cross-entropy per sample)
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _SSBOs[8]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, batchSize * sizeof(float), nullptr, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, _SSBOs[8]);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        // Dropout masks (9) too
+        // Batchnorm parameters
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _SSBOs[10]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, (_layout.nNormParams + 1) * sizeof(float), _norms, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 10, _SSBOs[10]);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        // Optimizer state, starts from zero
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _SSBOs[11]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, (optimizerStateSlots(OPTIMIZER) * (_nWeights + _nBiases) + 1) * sizeof(float), nullptr, GL_DYNAMIC_DRAW);
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32F, GL_RED, GL_FLOAT, nullptr);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 15, _SSBOs[11]);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        // Prune mask, optimizer.comp applies it after every update so the pruned weights stay 0. The weights are read
+        // back from the GPU (masked) before the layout changes, so their zeros are the pruned ones
+        _pruneMask.assign(_nWeights, 1.f);
+        if(_weightsPruned)
+            for(int i=0; i < _nWeights; i++)
+                _pruneMask[i] = _weights[i] != 0.f;
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _SSBOs[12]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, _nWeights * sizeof(float), _pruneMask.data(), GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 16, _SSBOs[12]);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        _optimizerStep = 0;
+    };
+    uploadNetwork();
+
+    // Input ring: the batches (inputs, targets & dropout masks) are written straight into a persistently & coherently
+    // mapped buffer, one slot per step in flight, instead of being copied through glBufferSubData. A slot's fence
+    // is waited on before the slot is written again, so the CPU prepares a batch while the GPU trains on the last ones.
+    // The slot also holds the step's copy of the first layer's DispatchParams records, with the per step fields filled in.
+    // Every section starts at a multiple of the SSBO & UBO offset alignments, the step binds its slot's sections as ranges.
+    int _ssboAlignment = 1;
+    glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &_ssboAlignment);
+    const int _ringAlignment = std::max(_ssboAlignment, _paramsAlignment);  // Both are powers of two
+    auto alignRing = [&](size_t bytes){ return (bytes + _ringAlignment - 1) / _ringAlignment * _ringAlignment; };
+    unsigned int _inputRing = 0;
+    char* _inputRingMapped = nullptr;
+    GLsync _inputRingFences[INPUT_RING_SLOTS] = {};
+    size_t _ringInputsBytes = 0, _ringTargetsOffset = 0, _ringTargetsBytes = 0, _ringMasksOffset = 0, _ringMasksBytes = 0, _ringParamsOffset = 0, _ringSlotBytes = 0;
+    auto waitInputSlot = [&](int slot){
+        if(!_inputRingFences[slot]) return;
+        glClientWaitSync(_inputRingFences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        glDeleteSync(_inputRingFences[slot]);
+        _inputRingFences[slot] = nullptr;
+    };
+    auto releaseInputRing = [&](){
+        for(int slot=0; slot < INPUT_RING_SLOTS; slot++)
+            waitInputSlot(slot);
+        if(!_inputRing) return;
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _inputRing);
+        glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        glDeleteBuffers(1, &_inputRing);
+        _inputRing = 0;
+        _inputRingMapped = nullptr;
+    };
+    // Sized from the layout (mask words), so it is allocated again whenever the network changes shape (pruning)
+    auto allocateInputRing = [&](){
+        releaseInputRing();
+        _ringInputsBytes = batchSize * _layout.inputNeurons * sizeof(float);
+        _ringTargetsOffset = alignRing(_ringInputsBytes);
+        _ringTargetsBytes = batchSize * sizeof(int);
+        _ringMasksOffset = _ringTargetsOffset + alignRing(_ringTargetsBytes);
+        _ringMasksBytes = (batchSize * _layout.maskStride + 1) * sizeof(uint64_t);
+        _ringParamsOffset = _ringMasksOffset + alignRing(_ringMasksBytes);
+        _ringSlotBytes = _ringParamsOffset + alignRing(N_DISPATCH_STAGES * _paramsStride);
+
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glGenBuffers(1, &_inputRing);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _inputRing);
+        glBufferStorage(GL_SHADER_STORAGE_BUFFER, INPUT_RING_SLOTS * _ringSlotBytes, nullptr, flags);
+        _inputRingMapped = (char*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, INPUT_RING_SLOTS * _ringSlotBytes, flags);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        if(!_inputRingMapped){
+            std::cerr << "ERROR::INPUT_RING_MAPPING_FAILED\n" << std::hex << glGetError() << std::dec << std::endl;
+            glfwTerminate();
+            exit(-1);
+        }
+    };
+    allocateInputRing();
+    // Binds one of the slot's records, for the dispatches that read per step fields
+    auto bindStepParams = [&](size_t slotBegin, int stage){
+        glBindBufferRange(GL_UNIFORM_BUFFER, DISPATCH_PARAMS_BINDING, _inputRing,
+                          (GLintptr)(slotBegin + _ringParamsOffset + stage * _paramsStride), sizeof(dispatchParams));
+    };
+
+    // Device dataset: a dataset that fits is uploaded once & batched by dataset_gather.comp, the CPU only issues dispatches
+    // (the dropout masks still come through the ring) and uploads a new permutation of the samples at every epoch.
+    // The epochs are permutations of the samples, where the host path draws every sample independently.
+    const size_t datasetBytes = _data.features.size() * sizeof(float) + _data.labels.size() * sizeof(int);
+    const bool _deviceDataset = datasetBytes <= DEVICE_DATASET_MAX_BYTES && _data.nSamples >= batchSize;
+    const int _stepsPerEpoch = _data.nSamples / batchSize;
+    unsigned int _datasetSSBOs[4] = {};  // Features, labels, permutation & targets
+    std::vector<int> _permutation(_deviceDataset ? _data.nSamples : 0);  // Shuffled on the CPU, a serial shuffle would idle the GPU
+    if(_deviceDataset){
+        glGenBuffers(4, _datasetSSBOs);
+        // Features
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _datasetSSBOs[0]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, _data.features.size() * sizeof(float), _data.features.data(), GL_STATIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 12, _datasetSSBOs[0]);
+        // Labels
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _datasetSSBOs[1]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, _data.labels.size() * sizeof(int), _data.labels.data(), GL_STATIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 13, _datasetSSBOs[1]);
+        // Permutation of the current epoch
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _datasetSSBOs[2]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, _data.nSamples * sizeof(int), nullptr, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, _datasetSSBOs[2]);
+        // Targets, gathered with the inputs so they take the ring's place at binding 7
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _datasetSSBOs[3]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, batchSize * sizeof(int), nullptr, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, _datasetSSBOs[3]);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
 
 
     // Base quad rendering init
@@ -312,10 +706,179 @@ int main() {
     glEnableVertexAttribArray(0);
 
 
+    // One training step on the GPU: fetch the batch, forward every layer, the loss, backward every layer, then update the parameters
+    uint64_t _step = 0;
+    auto trainStep = [&](){
+        #ifdef _DEBUG
+        size_t allocationsBefore = _allocations;
+        #endif
+        // The step's slot of the input ring, free again once the GPU is done with the step that last used it
+        int slot = (int)(_step % INPUT_RING_SLOTS);
+        waitInputSlot(slot);
+        size_t slotBegin = slot * _ringSlotBytes;
+        float* batchInputs = (float*)(_inputRingMapped + slotBegin);
+        int* batchTargets = (int*)(_inputRingMapped + slotBegin + _ringTargetsOffset);
+        uint64_t* batchMasks = (uint64_t*)(_inputRingMapped + slotBegin + _ringMasksOffset);
+
+        // A random row of the dataset for every sample, unless the GPU gathers the batch itself
+        for(int b=0; b < batchSize && !_deviceDataset; b++){
+            int sample = (int)(((uint64_t)rngUint(_seed, RNG_SAMPLE, 0, _step * batchSize + b) * _data.nSamples) >> 32);
+            std::copy_n(_data.features.data() + sample * _data.nFeatures, _data.nFeatures, batchInputs + b * _layout.inputNeurons);
+            batchTargets[b] = _data.labels[sample];
+        }
+        // Fresh masks every step, kept for the backward pass
+        for(int b=0; b < batchSize; b++)
+            for(int i=0; i < _nLayers; i++)
+                if(_forwardingLayers[i].maskBegin >= 0)
+                    dropoutMask(batchMasks + b * _layout.maskStride + _forwardingLayers[i].maskBegin, _forwardingLayers[i].dstNeurons,
+                                _forwardingLayers[i].keep, _seed, i, _step * batchSize + b);
+        // The step's DispatchParams: the batch's slice of the epoch's permutation & the optimizer's timestep
+        int firstSample = _deviceDataset ? (int)(_step % _stepsPerEpoch) * batchSize : 0;
+        for(int stage=0; stage < N_DISPATCH_STAGES; stage++){
+            dispatchParams params = layerDispatchParams(0, stage);
+            params.firstSample = firstSample;
+            params.timestep = _optimizerStep + 1;
+            std::memcpy(_inputRingMapped + slotBegin + _ringParamsOffset + stage * _paramsStride, &params, sizeof(params));
+        }
+
+        // The mapping is coherent, the writes above are visible to the commands below without any flush
+        glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 9, _inputRing, slotBegin + _ringMasksOffset, _ringMasksBytes);
+        if(_deviceDataset){
+            // A new permutation at the start of every epoch, then the batch's slice of it. The buffer is orphaned,
+            // so the upload doesn't wait on the batches of the last epoch still reading the old one
+            if(firstSample == 0){
+                std::iota(_permutation.begin(), _permutation.end(), 0);
+                rngShuffle(_permutation.data(), _data.nSamples, _seed, (uint32_t)(_step / _stepsPerEpoch));
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, _datasetSSBOs[2]);
+                glBufferData(GL_SHADER_STORAGE_BUFFER, _data.nSamples * sizeof(int), _permutation.data(), GL_DYNAMIC_DRAW);
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+            }
+            glUseProgram(_gatherModule);
+            bindStepParams(slotBegin, 0);
+        }
+        else{
+            glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 11, _inputRing, slotBegin, _ringInputsBytes);
+            glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 7, _inputRing, slotBegin + _ringTargetsOffset, _ringTargetsBytes);
+            glUseProgram(_batchInputModule);
+            bindDispatchParams(0, 0);
+        }
+        glDispatchCompute((batchSize * _layout.inputNeurons + 63)/64, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        // Small networks go forward in a single dispatch, one workgroup per sample. Otherwise one dispatch per layer
+        // over (neuron, sample): wide dense layers in shared memory tiles, the others with one invocation per output
+        if(_fusedForward){
+            glUseProgram(_fusedModule);
+            bindDispatchParams(0, 0);
+            glDispatchCompute(batchSize, 1, 1);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        }
+        else for (int i = 0; i < _nLayers; ++i) {
+            const forwardingLayer& layer = _forwardingLayers[i];
+            if(layer.type == LAYER_DENSE && layer.srcNeurons >= DENSE_TILED_MIN_SOURCES){
+                glUseProgram(_denseTiledModule);
+                bindDispatchParams(i, 0);
+                glDispatchCompute((layer.dstNeurons + DENSE_TILE_N - 1)/DENSE_TILE_N, (batchSize + DENSE_TILE_M - 1)/DENSE_TILE_M, 1);
+            }
+            else{
+                glUseProgram(_computeModule);
+                bindDispatchParams(i, 0);
+                glDispatchCompute((layer.dstNeurons + 7)/8, (batchSize + 7)/8, 1);
+            }
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+        }
+
+        // Softmax, loss and output deltas in one dispatch over the batch
+        glUseProgram(_lossModule);
+        bindDispatchParams(_layout.lossLayer, 0);
+        glDispatchCompute((batchSize + 31)/32, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        // Backward, last layer first: undo the epilogue, then propagate the deltas & reduce the gradients,
+        // which only read the layer's deltas so they share one barrier
+        glUseProgram(_backpropModule);
+        for (int i = _nLayers - 1; i >= 0; --i) {
+            const forwardingLayer& layer = _forwardingLayers[i];
+            bindDispatchParams(i, BACKPROP_EPILOGUE);
+            glDispatchCompute((layer.dstNeurons * batchSize + 63)/64, 1, 1);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+            if(layer.neurons.begin - layer.srcNeurons > 0){  // The input layer needs no deltas
+                bindDispatchParams(i, BACKPROP_PROPAGATE);
+                glDispatchCompute((layer.srcNeurons * batchSize + 63)/64, 1, 1);
+            }
+            // One workgroup per weight & bias, see the shader for the grid
+            bindDispatchParams(i, BACKPROP_GRADIENTS);
+            if(layer.type == LAYER_DENSE)
+                glDispatchCompute(layer.dstNeurons, layer.srcNeurons + 1, 1);
+            else if(layer.type == LAYER_CONV)
+                glDispatchCompute(layer.src.channels * layer.kernel * layer.kernel + 1, layer.dst.channels, 1);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        }
+
+        // Update every weight & bias in place, the parameters never leave the GPU while training
+        glUseProgram(_optimizerModule);
+        bindStepParams(slotBegin, 0);
+        glDispatchCompute((_nWeights + _nBiases + 63)/64, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        _optimizerStep++;
+
+        // The backward pass is the slot's last reader
+        _inputRingFences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        _step++;
+        #ifdef _DEBUG
+        // The first step also pays for the driver's first use of every program, the CPU plan's own check is tests/plan_allocations.cpp
+        if(_step > 1 && _allocations != allocationsBefore)
+            std::cerr << "WARNING::TRAINING_STEP_ALLOCATED\n" << _allocations - allocationsBefore << " heap allocations in step " << _step - 1 << std::endl;
+        #endif
+    };
+
+    int _exitCode = 0;
+    if(_headless){
+        // No frames to wait for, the steps are only limited by the GPU
+        auto start = std::chrono::steady_clock::now();
+        while(_step < HEADLESS_STEPS)
+            trainStep();
+        float* losses = new float[batchSize];
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _SSBOs[8]);
+        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, batchSize * sizeof(float), losses);  // Waits for the last step
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        float meanLoss = 0.f;
+        for(int b=0; b < batchSize; b++)
+            meanLoss += losses[b] / batchSize;
+        printf("%llu steps in %.2fs (%.0f samples/s), last batch loss %f\n", (unsigned long long)_step, seconds,
+               _step * batchSize / seconds, meanLoss);
+        delete[] losses;
+        // A headless run doubles as a check that long trainings stay finite, scripts can test the exit code
+        if(!std::isfinite(meanLoss)){
+            std::cerr << "ERROR::TRAINING_DIVERGED\nnon-finite loss after " << _step << " steps" << std::endl;
+            _exitCode = 1;
+        }
+    }
+
     ImVec4 clearColor = {};
     bool isTraining = false;
-    while(!glfwWindowShouldClose(_window))
+    double samplesPerSecond = 0.0;
+    auto lastFrame = std::chrono::steady_clock::now();
+    while(!_headless && !glfwWindowShouldClose(_window))
     {
+        // Train for a fixed share of the frame instead of one step per frame, so throughput isn't capped by vsync.
+        // Each chunk is waited on, so the budget counts GPU time and the GPU never queues more than a chunk.
+        // The visualizer reads whatever state the last chunk left, at its own refresh rate.
+        auto frameStart = std::chrono::steady_clock::now();
+        uint64_t frameFirstStep = _step;
+        while(isTraining && std::chrono::duration<double>(std::chrono::steady_clock::now() - frameStart).count() < TRAINING_FRAME_BUDGET){
+            for(int s=0; s < TRAINING_CHUNK_STEPS; s++)
+                trainStep();
+            GLsync chunkDone = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            glClientWaitSync(chunkDone, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+            glDeleteSync(chunkDone);
+        }
+        double frameSeconds = std::chrono::duration<double>(frameStart - lastFrame).count();
+        lastFrame = frameStart;
+        samplesPerSecond += 0.1 * ((_step - frameFirstStep) * batchSize / (frameSeconds > 0.0 ? frameSeconds : 1.0) - samplesPerSecond);
+
         glClearColor(clearColor.x, clearColor.y, clearColor.z, clearColor.w);
         glClear(GL_COLOR_BUFFER_BIT);
 
@@ -330,7 +893,7 @@ int main() {
 
         // Rendering commands here
         ImGui::SetNextWindowPos(ImVec2(0, 0), ImGuiCond_Always);
-        ImGui::SetNextWindowSize(io.DisplaySize, ImGuiCond_Always);
+        ImGui::SetNextWindowSize(ImGui::GetIO().DisplaySize, ImGuiCond_Always);
         ImGui::PushStyleVar(ImGuiStyleVar_WindowPadding, ImVec2(0, 0));
         ImGui::Begin("FullScreenWindow", nullptr,
             ImGuiWindowFlags_NoTitleBar |
@@ -345,6 +908,63 @@ int main() {
         ImGui::TableNextColumn();
             if(ImGui::Button(isTraining? "Stop Training": "Train"))
                 isTraining = !isTraining;
+            ImGui::Text("Step %llu, %.0f samples/s", (unsigned long long)_step, isTraining ? samplesPerSecond : 0.0);
+            // Removes the least useful hidden neurons, every buffer is rebuilt for the smaller layout
+            if(ImGui::Button("Prune neurons")){
+                planStorage storage;
+                storage.weights.resize(_nWeights);
+                storage.biases.resize(_nBiases);
+                storage.norms.resize(_layout.nNormParams);
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, _SSBOs[1]);
+                glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, _nWeights * sizeof(float), storage.weights.data());
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, _SSBOs[2]);
+                glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, _nBiases * sizeof(float), storage.biases.data());
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, _SSBOs[10]);
+                glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, _layout.nNormParams * sizeof(float), storage.norms.data());
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+                executionPlan plan;
+                compilePlan(_graph, _layout, plan);
+                if(structuredPrune(_graph, _layout, plan, storage, _data, PRUNE_FRACTION, PRUNE_CALIBRATION_SAMPLES) > 0){
+                    _nNeurons = _layout.nNeurons; _nWeights = _layout.nWeights; _nBiases = _layout.nBiases;
+                    _nLayers = (int)_layout.layers.size();
+                    _forwardingLayers = _layout.layers.data();
+
+                    delete[] _neurons; delete[] _weights; delete[] _biases; delete[] _norms;
+                    delete[] _weightGradients; delete[] _biasGradients;
+                    _neurons = new float[batchSize * _nNeurons]{0};
+                    _weights = new float[_nWeights];
+                    _biases = new float[_nBiases];
+                    _norms = new float[_layout.nNormParams + 1];
+                    _weightGradients = new float[_nWeights]{0};
+                    _biasGradients = new float[_nBiases]{0};
+                    std::copy(storage.weights.begin(), storage.weights.end(), _weights);
+                    std::copy(storage.biases.begin(), storage.biases.end(), _biases);
+                    std::copy(storage.norms.begin(), storage.norms.end(), _norms);
+                    uploadNetwork();
+                    allocateInputRing();
+
+                    writeDispatchParams();
+                    glUseProgram(_renderModule);
+                    glUniform1i(_layersCountLocation, _nLayers);
+                }
+            }
+            // Zeroes the smallest weights of every hidden dense layer, they stay 0 while training goes on
+            if(ImGui::Button("Prune weights")){
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, _SSBOs[1]);
+                glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, _nWeights * sizeof(float), _weights);
+                for(int i=0; i < _nLayers; i++){
+                    const forwardingLayer& layer = _layout.layers[i];
+                    if(layer.type != LAYER_DENSE || i == _layout.lossLayer) continue;
+                    float sparsity = 1.f - weightDensity(layer, _weights) * (1.f - WEIGHT_PRUNE_FRACTION);
+                    pruneWeights(layer, _weights, pruningThreshold(layer, _weights, sparsity), _pruneMask.data());
+                }
+                _weightsPruned = true;
+                glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, _nWeights * sizeof(float), _weights);
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, _SSBOs[12]);
+                glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, _nWeights * sizeof(float), _pruneMask.data());
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+            }
         ImGui::TableNextColumn();
             pos = ImGui::GetCursorScreenPos();
             ImVec2 size = ImGui::GetContentRegionAvail();
@@ -352,49 +972,6 @@ int main() {
             glfwGetFramebufferSize(_window, &w, &h);
             glViewport(pos.x, h - pos.y - size.y, size.x, size.y);
 
-            // Compute
-            if(isTraining) {
-                glUseProgram(_computeModule);
-                // Populate input layer with a random set from the dataset
-                std::ifstream datafile(DATA_FILENAME);
-                if (!datafile.is_open()) {
-                    std::cerr << "Failed to open data file: " << DATA_FILENAME << std::endl;
-                    break;
-                }
-
-                datafile.seekg(0, std::ios::end);
-                int fileSize = datafile.tellg();
-                
-                int startByte = rand()%(fileSize); // Where to start looking for a line
-                datafile.seekg(startByte, std::ios::beg);
-                std::string line;
-                std::getline(datafile, line);
-                std::getline(datafile, line);
-                
-                if(!line.empty()){
-                    std::stringstream ss(line);
-
-                    std::string value;
-                    for(int i=0; i < 4; i++){
-                        getline(ss, value, ',');
-                        #ifdef _DEBUG
-                            std::cout << "Data file value: " << value << " of line: " << line << std::endl;
-                        #endif
-                        _neurons[i] = std::stof(value);
-                    }
-                    getline(ss, value, ',');
-                    if(_targets.find(value) == _targets.end())
-                        _targets[value] = _nTargets++;
-                    int target = _targets[value];
-                    
-                    // glUniform1i(glGetUniformLocation(_computeModule, "targetIdx"), target);
-                    for (int i = 0; i < nplLength - 1; ++i) {
-                        glUniform1i(glGetUniformLocation(_computeModule, "layerIdx"), i);
-                        glDispatchCompute((NODES_PER_LAYER[i+1] + 31)/32, 1, 1);
-                        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
-                    }
-                }
-            }
         ImGui::EndTable();
         ImGui::End();
         ImGui::PopStyleVar();
@@ -406,7 +983,7 @@ int main() {
             // Show visual representation of NN
             // glPolygonMode(GL_FRONT, GL_FILL);
             glUseProgram(_renderModule);
-            glUniform1f(glGetUniformLocation(_renderModule, "aspectRatio"), size.x/size.y);
+            glUniform1f(_aspectRatioLocation, size.x/size.y);
             glBindVertexArray(_VAO);
             // glActiveTexture(GL_TEXTURE0);
             // glBindTexture(GL_TEXTURE_BUFFER, _neuronTexBuffer);
@@ -423,20 +1000,31 @@ int main() {
     delete[] _neurons;
     delete[] _weights;
     delete[] _biases;
-    delete[] _forwardingLayers;
-    _neurons = _weights = _biases = nullptr;
-    _forwardingLayers = nullptr;
-
-    // Clean glfw
-    ImGui_ImplGlfw_Shutdown();
-    ImGui_ImplOpenGL3_Shutdown();
-    ImGui::DestroyContext();
-    glfwTerminate();
+    delete[] _norms;
+    delete[] _weightGradients;
+    delete[] _biasGradients;
+    _neurons = _weights = _biases = _norms = nullptr;
 
-    glDeleteProgram(_renderModule);
+    for(int m=0; m < N_MODULES; m++)
+        glDeleteProgram(_modules[m]);
+    releaseInputRing();
     glDeleteBuffers(nBuffers, _SSBOs);
+    glDeleteBuffers(4, _datasetSSBOs);
+    glDeleteBuffers(1, &_paramsUBO);
     glDeleteBuffers(1, &_VBO);
 
+    // Clean glfw, the GL objects above have to go first while the context still exists
+    if(!_headless){
+        ImGui_ImplGlfw_Shutdown();
+        ImGui_ImplOpenGL3_Shutdown();
+        ImGui::DestroyContext();
+    }
+    glfwTerminate();
+    #ifdef HEADLESS_EGL
+    if(_eglDisplay != EGL_NO_DISPLAY)
+        eglTerminate(_eglDisplay);
+    #endif
+
 
-    return 0;
+    return _exitCode;
 }
@@ -0,0 +1,88 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+// Bump pointer arena for memory that lives exactly one step
+// Allocating is an aligned pointer bump, nothing is freed individually, the whole arena is reset instead.
+// Blocks are kept across resets, so once the first step has grown the arena to its working size
+// the following steps never touch the heap.
+
+const size_t ARENA_ALIGNMENT = 64;       // Cache line, also enough for any SIMD load
+const size_t ARENA_BLOCK_SIZE = 1 << 16;
+
+struct arena{
+    std::vector<char*> blocks;
+    std::vector<size_t> sizes;
+    size_t current = 0;   // Block being bumped into
+    size_t used = 0;      // Bytes used in the current block
+
+    arena() = default;
+    // The blocks are owned, a copy would free them twice
+    arena(const arena&) = delete;
+    arena& operator=(const arena&) = delete;
+    ~arena();
+};
+
+/// Utility function to get the next aligned offset of a block
+inline size_t arenaAlign(const char* block, size_t offset){
+    uintptr_t address = (uintptr_t)(block + offset);
+    return offset + ((ARENA_ALIGNMENT - address % ARENA_ALIGNMENT) % ARENA_ALIGNMENT);
+}
+
+/// Allocates bytes from the arena, ARENA_ALIGNMENT aligned
+/// Moves on to the next block (allocating one if needed) when the current one is full.
+inline void* arenaAlloc(arena& a, size_t bytes){
+    while(a.current < a.blocks.size()){
+        size_t offset = arenaAlign(a.blocks[a.current], a.used);
+        if(offset + bytes <= a.sizes[a.current]){
+            a.used = offset + bytes;
+            return a.blocks[a.current] + offset;
+        }
+        a.current++;
+        a.used = 0;
+    }
+
+    size_t size = bytes + ARENA_ALIGNMENT > ARENA_BLOCK_SIZE ? bytes + ARENA_ALIGNMENT : ARENA_BLOCK_SIZE;
+    a.blocks.push_back(new char[size]);
+    a.sizes.push_back(size);
+    a.current = a.blocks.size() - 1;
+    size_t offset = arenaAlign(a.blocks[a.current], 0);
+    a.used = offset + bytes;
+    return a.blocks[a.current] + offset;
+}
+
+/// Allocates an uninitialized array from the arena
+template<class T>
+inline T* arenaArray(arena& a, size_t length){
+    static_assert(std::is_trivially_destructible<T>::value, "arena memory is never destructed");
+    return static_cast<T*>(arenaAlloc(a, length * sizeof(T)));
+}
+
+/// Copies a value into the arena
+template<class T>
+inline T* arenaCopy(arena& a, const T& value){
+    static_assert(std::is_trivially_destructible<T>::value, "arena memory is never destructed");
+    return new(arenaAlloc(a, sizeof(T))) T(value);
+}
+
+/// Makes all of the arena's memory available again, every pointer it handed out becomes invalid
+inline void arenaReset(arena& a){
+    a.current = 0;
+    a.used = 0;
+}
+
+/// Returns the arena's blocks to the heap, the destructor does it too
+inline void arenaFree(arena& a){
+    for(char* block: a.blocks)
+        delete[] block;
+    a.blocks.clear();
+    a.sizes.clear();
+    arenaReset(a);
+}
+
+inline arena::~arena(){
+    arenaFree(*this);
+}
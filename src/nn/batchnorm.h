@@ -0,0 +1,153 @@
+#pragma once
+#include <cmath>
+#include "layers.h"
+#include "dense.h"
+
+// Batch normalization of a dense or conv layer's pre-activations, applied between the matmul and the activation.
+// Statistics are per channel (a dense layer has one channel per neuron, a conv layer shares them over the plane).
+// Parameters of a layer live in one flat range: gamma, beta, running mean & running variance, dst.channels each.
+// For inference the layer is folded into the weights & biases, leaving a plain dense/conv layer (foldNormalization in nn/plan.h).
+// Only the CPU plan trains it (batch statistics, running statistics & the gamma/beta gradients). The shaders'
+// epilogue applies the running statistics as they are, so main.cpp refuses to train a batchnorm network on the GPU.
+
+const float BN_MOMENTUM = 0.1f;  // Weight of the current batch in the running statistics
+const float BN_EPSILON = 1e-5f;
+
+/// Utility function to get the number of floats taken by a layer's parameters
+inline int batchNormParams(int channels){
+    return 4 * channels;
+}
+
+/// Resets a layer's parameters to the identity transform (gamma 1, beta 0, mean 0, variance 1)
+inline void batchNormInit(float* params, int channels){
+    for(int c=0; c < channels; c++){
+        params[c] = 1.f;
+        params[channels + c] = 0.f;
+        params[2 * channels + c] = 0.f;
+        params[3 * channels + c] = 1.f;
+    }
+}
+
+/// Normalizes the pre-activations of a layer, then applies the activation + dropout epilogue
+/// The layer must have been run with ACT_NONE. While training the batch statistics are used
+/// and folded into the running ones, otherwise the running statistics are used.
+/// layer - ranges & shapes of the layer
+/// params - the layer's parameters (batchNormParams(dst.channels) long)
+/// neurons - activations of the batch, the layer's range is overwritten
+/// act - the activation that follows the normalization
+/// training - whether to use & update the batch statistics
+/// xhat - scratch for the normalized values, same layout as the neurons, kept for the backward pass
+/// invStd - scratch for 1/sqrt(variance + epsilon) of each channel, kept for the backward pass
+/// masks, maskStride, keep - the dropout masks of the layer
+inline void batchNormForward(const forwardingLayer& layer, float* params, float* neurons, int batch, int stride,
+                             activation act, bool training, float* xhat, float* invStd,
+                             const uint64_t* masks = nullptr, int maskStride = 0, float keep = 1.f){
+    int channels = layer.dst.channels, plane = layer.dst.height * layer.dst.width;
+    float* gamma = params;
+    float* beta = params + channels;
+    float* runningMean = params + 2 * channels;
+    float* runningVar = params + 3 * channels;
+    int count = batch * plane;
+
+    for(int c=0; c < channels; c++){
+        float mean = runningMean[c], var = runningVar[c];
+        if(training){
+            mean = 0.f;
+            for(int b=0; b < batch; b++)
+                for(int p=0; p < plane; p++)
+                    mean += neurons[b * stride + layer.neurons.begin + c * plane + p];
+            mean /= count;
+            var = 0.f;
+            for(int b=0; b < batch; b++)
+                for(int p=0; p < plane; p++){
+                    float diff = neurons[b * stride + layer.neurons.begin + c * plane + p] - mean;
+                    var += diff * diff;
+                }
+            var /= count;
+
+            // The running variance is unbiased, the batch one is not
+            runningMean[c] += BN_MOMENTUM * (mean - runningMean[c]);
+            runningVar[c] += BN_MOMENTUM * ((count > 1 ? var * count / (count - 1) : var) - runningVar[c]);
+        }
+        invStd[c] = 1.f / std::sqrt(var + BN_EPSILON);
+        for(int b=0; b < batch; b++)
+            for(int p=0; p < plane; p++){
+                int idx = b * stride + layer.neurons.begin + c * plane + p;
+                float normalized = (neurons[idx] - mean) * invStd[c];
+                xhat[idx] = normalized;
+                neurons[idx] = gamma[c] * normalized + beta[c];
+            }
+    }
+
+    for(int b=0; b < batch; b++)
+        activationForward(neurons + b * stride + layer.neurons.begin, layer.dstNeurons, act, masks ? masks + b * maskStride : nullptr, keep);
+}
+
+/// Backward pass of batchNormForward (training mode)
+/// On entry the layer's deltas hold dLoss/dOutput, on exit they hold dLoss/dPreNormalization,
+/// ready for denseBackward with ACT_NONE. Gamma & beta gradients are accumulated.
+/// params - the layer's parameters
+/// paramGradients - same layout as params, only the gamma & beta slots are accumulated into
+/// neurons - activations of the batch from the forward pass
+/// deltas - same layout as the neurons
+/// xhat, invStd - the scratch filled by the forward pass
+inline void batchNormBackward(const forwardingLayer& layer, const float* params, float* paramGradients, const float* neurons,
+                              float* deltas, int batch, int stride, activation act, const float* xhat, const float* invStd,
+                              const uint64_t* masks = nullptr, int maskStride = 0, float keep = 1.f){
+    int channels = layer.dst.channels, plane = layer.dst.height * layer.dst.width;
+    const float* gamma = params;
+    float* gammaGrad = paramGradients;
+    float* betaGrad = paramGradients + channels;
+    int count = batch * plane;
+
+    for(int b=0; b < batch; b++)
+        activationBackward(deltas + b * stride + layer.neurons.begin, neurons + b * stride + layer.neurons.begin, layer.dstNeurons, act,
+                           masks ? masks + b * maskStride : nullptr, keep);
+
+    for(int c=0; c < channels; c++){
+        float sumD = 0.f, sumDXhat = 0.f;
+        for(int b=0; b < batch; b++)
+            for(int p=0; p < plane; p++){
+                int idx = b * stride + layer.neurons.begin + c * plane + p;
+                sumD += deltas[idx];
+                sumDXhat += deltas[idx] * xhat[idx];
+            }
+        gammaGrad[c] += sumDXhat;
+        betaGrad[c] += sumD;
+
+        float scale = gamma[c] * invStd[c] / count;
+        for(int b=0; b < batch; b++)
+            for(int p=0; p < plane; p++){
+                int idx = b * stride + layer.neurons.begin + c * plane + p;
+                deltas[idx] = scale * (count * deltas[idx] - sumD - xhat[idx] * sumDXhat);
+            }
+    }
+}
+
+/// Folds a layer's running statistics and affine transform into its weights & biases
+/// Afterwards the layer alone (with the activation) computes what layer + batchnorm did at inference.
+/// layer - ranges & shapes of the dense or conv layer
+/// weights - all the weights, the layer's range is rescaled
+/// biases - all the biases, the layer's range is shifted
+/// params - the layer's batchnorm parameters
+inline void foldBatchNorm(const forwardingLayer& layer, float* weights, float* biases, const float* params){
+    int channels = layer.dst.channels;
+    const float* gamma = params;
+    const float* beta = params + channels;
+    const float* runningMean = params + 2 * channels;
+    const float* runningVar = params + 3 * channels;
+
+    float* w = weights + layer.weights.begin;
+    float* bias = biases + layer.biases.begin;
+    int taps = layer.src.channels * layer.kernel * layer.kernel;
+    for(int c=0; c < channels; c++){
+        float scale = gamma[c] / std::sqrt(runningVar[c] + BN_EPSILON);
+        if(layer.type == LAYER_CONV)
+            for(int t=0; t < taps; t++)
+                w[c * taps + t] *= scale;   // Every weight of the output channel
+        else
+            for(int i=0; i < layer.srcNeurons; i++)
+                w[i * channels + c] *= scale;   // Column of the dense matrix
+        bias[c] = (bias[c] - runningMean[c]) * scale + beta[c];
+    }
+}
@@ -0,0 +1,235 @@
+#pragma once
+#include <cfloat>
+#include "layers.h"
+#include "dense.h"
+#include "gemm.h"
+
+// Batched CPU kernels for the conv & pool layers, same [batch x stride] neuron layout as the dense ones.
+// Convolutions either lower to the GEMM through im2col, or for 3x3 & 5x5 stride 1 kernels
+// run directly with the kernel held in registers, which skips building the column matrix.
+
+/// Utility function to get the scratch floats needed by the im2col path of a conv layer
+/// (one sample's column matrix, [src channels * kernel * kernel] x [dst height * dst width])
+inline int convScratchSize(const forwardingLayer& layer){
+    return layer.src.channels * layer.kernel * layer.kernel * layer.dst.height * layer.dst.width;
+}
+
+/// Unfolds one sample's input into a column matrix, row (c, ky, kx) holds what the kernel tap sees at every output position
+/// in - the sample's source neurons
+/// col - output, convScratchSize(layer) long
+inline void im2col(const forwardingLayer& layer, const float* in, float* col){
+    int k = layer.kernel, outH = layer.dst.height, outW = layer.dst.width;
+    int inH = layer.src.height, inW = layer.src.width;
+    for(int c=0; c < layer.src.channels; c++)
+        for(int ky=0; ky < k; ky++)
+            for(int kx=0; kx < k; kx++){
+                float* row = col + ((c * k + ky) * k + kx) * outH * outW;
+                for(int oy=0; oy < outH; oy++){
+                    int iy = oy * layer.stride - layer.padding + ky;
+                    for(int ox=0; ox < outW; ox++){
+                        int ix = ox * layer.stride - layer.padding + kx;
+                        row[oy * outW + ox] = iy >= 0 && iy < inH && ix >= 0 && ix < inW ? in[(c * inH + iy) * inW + ix] : 0.f;
+                    }
+                }
+            }
+}
+
+/// Folds a column matrix of gradients back onto one sample's source deltas (accumulates, inverse of im2col)
+inline void col2im(const forwardingLayer& layer, const float* col, float* in){
+    int k = layer.kernel, outH = layer.dst.height, outW = layer.dst.width;
+    int inH = layer.src.height, inW = layer.src.width;
+    for(int c=0; c < layer.src.channels; c++)
+        for(int ky=0; ky < k; ky++)
+            for(int kx=0; kx < k; kx++){
+                const float* row = col + ((c * k + ky) * k + kx) * outH * outW;
+                for(int oy=0; oy < outH; oy++){
+                    int iy = oy * layer.stride - layer.padding + ky;
+                    if(iy < 0 || iy >= inH) continue;
+                    for(int ox=0; ox < outW; ox++){
+                        int ix = ox * layer.stride - layer.padding + kx;
+                        if(ix >= 0 && ix < inW)
+                            in[(c * inH + iy) * inW + ix] += row[oy * outW + ox];
+                    }
+                }
+            }
+}
+
+/// Direct convolution of one sample for a KxK stride 1 kernel
+/// Each (dst channel, src channel) kernel is loaded into registers once, then every tap is swept
+/// over the output rows with the valid column range precomputed, so the inner loop has no bounds checks.
+/// out - the sample's destination neurons, already holding the biases
+template<int K>
+inline void convDirect(const forwardingLayer& layer, const float* w, const float* in, float* out){
+    int outH = layer.dst.height, outW = layer.dst.width;
+    int inH = layer.src.height, inW = layer.src.width;
+    int pad = layer.padding;
+    for(int oc=0; oc < layer.dst.channels; oc++){
+        float* o = out + oc * outH * outW;
+        for(int ic=0; ic < layer.src.channels; ic++){
+            float kern[K * K];
+            for(int t=0; t < K * K; t++)
+                kern[t] = w[(oc * layer.src.channels + ic) * K * K + t];
+            const float* src = in + ic * inH * inW;
+
+            for(int oy=0; oy < outH; oy++){
+                float* oRow = o + oy * outW;
+                for(int ky=0; ky < K; ky++){
+                    int iy = oy - pad + ky;
+                    if(iy < 0 || iy >= inH) continue;
+                    const float* iRow = src + iy * inW;
+                    for(int kx=0; kx < K; kx++){
+                        float wt = kern[ky * K + kx];
+                        // Output columns whose tap lands inside the row
+                        int oxBegin = pad - kx > 0 ? pad - kx : 0;
+                        int oxEnd = inW + pad - kx < outW ? inW + pad - kx : outW;
+                        const float* iTap = iRow - pad + kx;
+                        for(int ox=oxBegin; ox < oxEnd; ox++)
+                            oRow[ox] += wt * iTap[ox];
+                    }
+                }
+            }
+        }
+    }
+}
+
+/// Forward pass of a conv layer over a batch with the activation + dropout epilogue
+/// layer - ranges & shapes of the layer
+/// weights - all the weights, layer.weights indexes into it
+/// biases - all the biases, one per dst channel
+/// neurons - activations of the batch, the layer's range is overwritten
+/// scratch - convScratchSize(layer) floats, only used by the im2col path
+/// masks, maskStride, keep - optional dropout masks of the layer
+inline void convForward(const forwardingLayer& layer, const float* weights, const float* biases, float* neurons,
+                        int batch, int stride, activation act, float* scratch,
+                        const uint64_t* masks = nullptr, int maskStride = 0, float keep = 1.f){
+    const float* w = weights + layer.weights.begin;
+    const float* bias = biases + layer.biases.begin;
+    int plane = layer.dst.height * layer.dst.width;
+    int taps = layer.src.channels * layer.kernel * layer.kernel;
+    bool direct = layer.stride == 1 && (layer.kernel == 3 || layer.kernel == 5);
+
+    for(int b=0; b < batch; b++){
+        const float* in = neurons + b * stride + layer.neurons.begin - layer.srcNeurons;
+        float* out = neurons + b * stride + layer.neurons.begin;
+
+        for(int oc=0; oc < layer.dst.channels; oc++)
+            for(int p=0; p < plane; p++)
+                out[oc * plane + p] = bias[oc];
+
+        if(direct && layer.kernel == 3)
+            convDirect<3>(layer, w, in, out);
+        else if(direct)
+            convDirect<5>(layer, w, in, out);
+        else{
+            // [dst channels x taps] * [taps x plane]
+            im2col(layer, in, scratch);
+            gemm(layer.dst.channels, plane, taps, w, taps, scratch, plane, out, plane);
+        }
+
+        activationForward(out, layer.dstNeurons, act, masks ? masks + b * maskStride : nullptr, keep);
+    }
+}
+
+/// Backward pass of a conv layer over a batch, same contract as denseBackward
+/// scratch - convScratchSize(layer) floats
+inline void convBackward(const forwardingLayer& layer, const float* weights, const float* neurons, float* deltas,
+                         float* weightGradients, float* biasGradients, int batch, int stride, activation act, bool propagate,
+                         float* scratch, const uint64_t* masks = nullptr, int maskStride = 0, float keep = 1.f){
+    const float* w = weights + layer.weights.begin;
+    float* wGrad = weightGradients + layer.weights.begin;
+    float* bGrad = biasGradients + layer.biases.begin;
+    int plane = layer.dst.height * layer.dst.width;
+    int taps = layer.src.channels * layer.kernel * layer.kernel;
+
+    for(int b=0; b < batch; b++){
+        const float* in = neurons + b * stride + layer.neurons.begin - layer.srcNeurons;
+        const float* out = neurons + b * stride + layer.neurons.begin;
+        float* d = deltas + b * stride + layer.neurons.begin;
+
+        activationBackward(d, out, layer.dstNeurons, act, masks ? masks + b * maskStride : nullptr, keep);
+        for(int oc=0; oc < layer.dst.channels; oc++)
+            for(int p=0; p < plane; p++)
+                bGrad[oc] += d[oc * plane + p];
+
+        // dW += d * col^T
+        im2col(layer, in, scratch);
+        gemmNT(layer.dst.channels, taps, plane, d, plane, scratch, plane, wGrad, taps);
+
+        // dCol = W^T * d, folded back onto the source deltas
+        if(propagate){
+            float* srcD = d - layer.srcNeurons;
+            for(int i=0; i < layer.srcNeurons; i++)
+                srcD[i] = 0.f;
+            for(int i=0; i < taps * plane; i++)
+                scratch[i] = 0.f;
+            gemmTN(taps, plane, layer.dst.channels, w, taps, d, plane, scratch, plane);
+            col2im(layer, scratch, srcD);
+        }
+    }
+}
+
+/// Forward pass of a max or average pool layer over a batch (windows are clipped at the borders)
+inline void poolForward(const forwardingLayer& layer, float* neurons, int batch, int stride){
+    int outH = layer.dst.height, outW = layer.dst.width;
+    int inH = layer.src.height, inW = layer.src.width;
+    for(int b=0; b < batch; b++){
+        const float* in = neurons + b * stride + layer.neurons.begin - layer.srcNeurons;
+        float* out = neurons + b * stride + layer.neurons.begin;
+        for(int c=0; c < layer.dst.channels; c++)
+            for(int oy=0; oy < outH; oy++)
+                for(int ox=0; ox < outW; ox++){
+                    float maxVal = -FLT_MAX, sum = 0.f;
+                    int count = 0;
+                    for(int ky=0; ky < layer.kernel; ky++){
+                        int iy = oy * layer.stride - layer.padding + ky;
+                        if(iy < 0 || iy >= inH) continue;
+                        for(int kx=0; kx < layer.kernel; kx++){
+                            int ix = ox * layer.stride - layer.padding + kx;
+                            if(ix < 0 || ix >= inW) continue;
+                            float v = in[(c * inH + iy) * inW + ix];
+                            maxVal = v > maxVal ? v : maxVal;
+                            sum += v;
+                            count++;
+                        }
+                    }
+                    out[(c * outH + oy) * outW + ox] = layer.type == LAYER_MAXPOOL ? maxVal : sum / count;
+                }
+    }
+}
+
+/// Backward pass of a pool layer over a batch, overwrites the source deltas
+/// Max pool routes each delta to the window's first largest input, found again instead of storing the argmax.
+inline void poolBackward(const forwardingLayer& layer, const float* neurons, float* deltas, int batch, int stride){
+    int outH = layer.dst.height, outW = layer.dst.width;
+    int inH = layer.src.height, inW = layer.src.width;
+    for(int b=0; b < batch; b++){
+        const float* in = neurons + b * stride + layer.neurons.begin - layer.srcNeurons;
+        const float* d = deltas + b * stride + layer.neurons.begin;
+        float* srcD = deltas + b * stride + layer.neurons.begin - layer.srcNeurons;
+        for(int i=0; i < layer.srcNeurons; i++)
+            srcD[i] = 0.f;
+
+        for(int c=0; c < layer.dst.channels; c++)
+            for(int oy=0; oy < outH; oy++)
+                for(int ox=0; ox < outW; ox++){
+                    int o = (c * outH + oy) * outW + ox;
+                    int y0 = oy * layer.stride - layer.padding, x0 = ox * layer.stride - layer.padding;
+                    int yBegin = y0 > 0 ? y0 : 0, yEnd = y0 + layer.kernel < inH ? y0 + layer.kernel : inH;
+                    int xBegin = x0 > 0 ? x0 : 0, xEnd = x0 + layer.kernel < inW ? x0 + layer.kernel : inW;
+                    if(layer.type == LAYER_MAXPOOL){
+                        int argmax = (c * inH + yBegin) * inW + xBegin;
+                        for(int iy=yBegin; iy < yEnd; iy++)
+                            for(int ix=xBegin; ix < xEnd; ix++)
+                                if(in[(c * inH + iy) * inW + ix] > in[argmax])
+                                    argmax = (c * inH + iy) * inW + ix;
+                        srcD[argmax] += d[o];
+                    }
+                    else{
+                        float share = d[o] / ((yEnd - yBegin) * (xEnd - xBegin));
+                        for(int iy=yBegin; iy < yEnd; iy++)
+                            for(int ix=xBegin; ix < xEnd; ix++)
+                                srcD[(c * inH + iy) * inW + ix] += share;
+                    }
+                }
+    }
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <cstdint>
+#include <exception>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+// A CSV dataset parsed once at startup, every row is nFeatures numbers followed by a class name
+// The training step only indexes into it, so no file access, string or stream is created per step.
+
+struct dataset{
+    std::vector<float> features;       // [nSamples x nFeatures]
+    std::vector<int> labels;           // Class index of each sample
+    std::vector<std::string> classes;  // Class names in order of first appearance
+    int nFeatures;
+    int nSamples;
+};
+
+/// Loads a whole CSV dataset into memory
+/// path - the file to read
+/// nFeatures - numbers before the class name on every row
+/// data - output
+/// returns - false if the file cannot be read, has a malformed row or holds no samples (the reason is printed)
+inline bool loadDataset(const char* path, int nFeatures, dataset& data){
+    data = dataset{};
+    data.nFeatures = nFeatures;
+    std::ifstream file(path);
+    if(!file.is_open()){
+        std::cerr << "Failed to open data file: " << path << std::endl;
+        return false;
+    }
+
+    std::unordered_map<std::string, int> classIndices;
+    std::string line, value;
+    int lineNumber = 0;
+    while(std::getline(file, line)){
+        lineNumber++;
+        if(line.empty() || line == "\r")
+            continue;
+
+        std::stringstream ss(line);
+        for(int i=0; i < nFeatures; i++){
+            if(!std::getline(ss, value, ',')){
+                std::cerr << "ERROR::DATASET_ROW_TOO_SHORT\n" << path << ":" << lineNumber << std::endl;
+                return false;
+            }
+            try{
+                data.features.push_back(std::stof(value));
+            }
+            catch(const std::exception&){  // Not a number, or out of float range
+                std::cerr << "ERROR::DATASET_BAD_NUMBER\n" << path << ":" << lineNumber << ": \"" << value << "\"" << std::endl;
+                return false;
+            }
+        }
+        std::getline(ss, value, ',');
+        if(!value.empty() && value.back() == '\r')
+            value.pop_back();
+        auto found = classIndices.find(value);
+        if(found == classIndices.end()){
+            found = classIndices.emplace(value, (int)data.classes.size()).first;
+            data.classes.push_back(value);
+        }
+        data.labels.push_back(found->second);
+    }
+
+    data.nSamples = (int)data.labels.size();
+    if(data.nSamples == 0){
+        std::cerr << "ERROR::DATASET_EMPTY\n" << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// Utility function to get the fraction of the features that are not 0
+/// maxSamples - samples spread evenly over the dataset that are looked at, all of them if there are fewer
+inline float datasetDensity(const dataset& data, int maxSamples){
+    int samples = data.nSamples < maxSamples ? data.nSamples : maxSamples;
+    int64_t nonzero = 0;
+    for(int i=0; i < samples; i++){
+        const float* features = data.features.data() + (int64_t)i * data.nSamples / samples * data.nFeatures;
+        for(int f=0; f < data.nFeatures; f++)
+            nonzero += features[f] != 0.f;
+    }
+    return samples && data.nFeatures ? (float)nonzero / ((int64_t)samples * data.nFeatures) : 1.f;
+}
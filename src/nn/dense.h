@@ -0,0 +1,157 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include "layers.h"
+#include "dropout.h"
+#include "gemm.h"
+
+// Batched CPU kernels for the dense layers
+// Neurons (and deltas) of a batch are laid out [batch x stride], one full copy of the network per sample,
+// the layer's inputs are the srcNeurons right before layer.neurons.begin.
+
+/// Activation + dropout epilogue of one sample, applied in place to the pre-activations
+/// out - the layer's pre-activations, replaced with its outputs
+/// mask - optional packed dropout mask of the sample
+/// keep - the keep probability the mask was generated with
+inline void activationForward(float* out, int neurons, activation act, const uint64_t* mask, float keep){
+    float keepScale = 1.f / keep;
+    for(int j=0; j < neurons; j++){
+        float x = out[j];
+        float y = act == ACT_SOFTPLUS ? (x > 20.f ? x : std::log1p(std::exp(x))) : x;
+        if(mask)
+            y = dropoutKept(mask, j) ? y * keepScale : 0.f;
+        out[j] = y;
+    }
+}
+
+/// Backward of activationForward for one sample, turns dLoss/dOutput into dLoss/dPreActivation in place
+/// The activation's derivative is recovered from the stored outputs, so no pre-activations are kept.
+/// d - the layer's deltas
+/// out - the layer's outputs from the forward pass
+inline void activationBackward(float* d, const float* out, int neurons, activation act, const uint64_t* mask, float keep){
+    float keepScale = 1.f / keep;
+    for(int j=0; j < neurons; j++){
+        float g = d[j];
+        float y = out[j];
+        if(mask){
+            bool kept = dropoutKept(mask, j);
+            g = kept ? g * keepScale : 0.f;
+            y = kept ? y * keep : 0.f;
+        }
+        if(act == ACT_SOFTPLUS)
+            g *= 1.f - std::exp(-y);  // softplus' = sigmoid = 1 - e^-softplus
+        d[j] = g;
+    }
+}
+
+/// Forward pass of a dense layer over a batch with a fused bias + activation + dropout epilogue
+/// layer - ranges of the layer
+/// weights - all the weights, layer.weights indexes into it ([src][dst] order), float, bf16 or fp16
+/// biases - all the biases, layer.biases indexes into it
+/// neurons - activations of the batch, the layer's range is overwritten
+/// batch - the number of samples
+/// stride - distance in floats between the neurons of consecutive samples
+/// act - the activation of the layer
+/// masks - optional packed dropout masks, maskStride words apart per sample
+/// maskStride - distance in words between the masks of consecutive samples
+/// keep - the keep probability the masks were generated with, kept neurons are scaled by 1/keep
+template<class W>
+inline void denseForward(const forwardingLayer& layer, const W* weights, const float* biases, float* neurons,
+                         int batch, int stride, activation act,
+                         const uint64_t* masks = nullptr, int maskStride = 0, float keep = 1.f){
+    const W* w = weights + layer.weights.begin;
+    const float* bias = biases + layer.biases.begin;
+    int dst = layer.dstNeurons;
+
+    const float* in = neurons + layer.neurons.begin - layer.srcNeurons;
+    float* out = neurons + layer.neurons.begin;
+
+    // [batch x src] * [src x dst] on top of the biases
+    for(int b=0; b < batch; b++)
+        for(int j=0; j < dst; j++)
+            out[b * stride + j] = bias[j];
+    gemm(batch, dst, layer.srcNeurons, in, stride, w, dst, out, stride);
+
+    for(int b=0; b < batch; b++)
+        activationForward(out + b * stride, dst, act, masks ? masks + b * maskStride : nullptr, keep);
+}
+
+/// Forward pass of a dense layer whose inputs are mostly 0 (e.g. the blank pixels feeding the first layer),
+/// same contract as denseForward
+/// The nonzero inputs of each sample are gathered first, then only their weight rows are accumulated,
+/// so the work scales with the number of nonzero inputs instead of srcNeurons.
+template<class W>
+inline void denseForwardSparseInput(const forwardingLayer& layer, const W* weights, const float* biases, float* neurons,
+                                    int batch, int stride, activation act,
+                                    const uint64_t* masks = nullptr, int maskStride = 0, float keep = 1.f){
+    const W* w = weights + layer.weights.begin;
+    const float* bias = biases + layer.biases.begin;
+    int dst = layer.dstNeurons;
+    const int CHUNK = 256;  // Inputs gathered at a time, keeps the index list on the stack
+    int nonzero[CHUNK];
+
+    for(int b=0; b < batch; b++){
+        const float* in = neurons + b * stride + layer.neurons.begin - layer.srcNeurons;
+        float* out = neurons + b * stride + layer.neurons.begin;
+        for(int j=0; j < dst; j++)
+            out[j] = bias[j];
+
+        for(int i0=0; i0 < layer.srcNeurons; i0 += CHUNK){
+            int i1 = i0 + CHUNK < layer.srcNeurons ? i0 + CHUNK : layer.srcNeurons;
+            int count = 0;
+            for(int i=i0; i < i1; i++){
+                nonzero[count] = i;
+                count += in[i] != 0.f;   // Branchless, the index is only kept if the input is not 0
+            }
+            for(int n=0; n < count; n++)
+                gemmAxpy(in[nonzero[n]], w + nonzero[n] * dst, out, dst);
+        }
+        activationForward(out, dst, act, masks ? masks + b * maskStride : nullptr, keep);
+    }
+}
+
+/// Backward pass of a dense layer over a batch
+/// On entry the layer's deltas hold dLoss/dOutput, they are turned into dLoss/dPreActivation in place,
+/// the weight & bias gradients are accumulated and the deltas of the source layer are overwritten.
+/// layer - ranges of the layer
+/// weights - all the weights
+/// neurons - activations of the batch from the forward pass
+/// deltas - same layout as the neurons
+/// weightGradients - all the weight gradients, accumulated into
+/// biasGradients - all the bias gradients, accumulated into
+/// propagate - whether to write the deltas of the source layer (not needed for the input layer)
+/// masks, maskStride, keep - the dropout masks used by the forward pass
+/// transposedWeights - optional copy of all the weights with each layer's block stored [dst][src],
+///                     lets the source deltas stream through rows instead of reducing over strided dot products
+inline void denseBackward(const forwardingLayer& layer, const float* weights, const float* neurons, float* deltas,
+                          float* weightGradients, float* biasGradients, int batch, int stride, activation act, bool propagate,
+                          const uint64_t* masks = nullptr, int maskStride = 0, float keep = 1.f,
+                          const float* transposedWeights = nullptr){
+    const float* w = weights + layer.weights.begin;
+    float* wGrad = weightGradients + layer.weights.begin;
+    float* bGrad = biasGradients + layer.biases.begin;
+    int src = layer.srcNeurons, dst = layer.dstNeurons;
+
+    const float* in = neurons + layer.neurons.begin - src;
+    const float* out = neurons + layer.neurons.begin;
+    float* d = deltas + layer.neurons.begin;
+    float* srcD = d - src;
+
+    for(int b=0; b < batch; b++){
+        activationBackward(d + b * stride, out + b * stride, dst, act, masks ? masks + b * maskStride : nullptr, keep);
+        for(int j=0; j < dst; j++)
+            bGrad[j] += d[b * stride + j];
+    }
+
+    // dW += in^T * d, dIn = d * W^T
+    gemmTN(src, dst, batch, in, stride, d, stride, wGrad, dst);
+    if(propagate){
+        for(int b=0; b < batch; b++)
+            for(int i=0; i < src; i++)
+                srcD[b * stride + i] = 0.f;
+        if(transposedWeights)
+            gemm(batch, src, dst, d, stride, transposedWeights + layer.weights.begin, src, srcD, stride);
+        else
+            gemmNT(batch, src, dst, d, stride, w, dst, srcD, stride);
+    }
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <string>
+#include "layers.h"
+
+// Constants of one compute dispatch, read by the shaders from a std140 uniform block instead of loose uniforms
+// The host lays out one record per dispatch up front & binds the right one with glBindBufferRange, so a
+// dispatch costs no uniform lookup or upload. Layer independent fields are the same in every record.
+// The fields that change every step are zero in those records, the dispatches reading them bind a per step copy
+// of the first layer's records instead, written by the host with the step's batch (input ring, main.cpp).
+// Mirrored by the shaders through dispatchParamsGLSL(), keep DISPATCH_PARAMS_FIELDS in sync
+struct dispatchParams{
+    int layerIdx;       // Layer the dispatch works on
+    int stage;          // Stage of the multi-stage shaders (backprop.comp)
+    int batchSize;
+    int neuronsStride;  // Neurons of one sample, the distance between consecutive samples
+    int maskStride;     // Dropout mask words (uint pairs) of one sample
+    int nLayers;
+    int lossLayer;      // Layer whose outputs are the logits
+    int nWeights;
+    int nBiases;
+    // Optimizer (optimizer.comp)
+    float learningRate;
+    float momentum;
+    float adamBeta1;
+    float adamBeta2;
+    float adamEpsilon;
+    // Per step (dataset_gather.comp, optimizer.comp)
+    int firstSample;     // Position of the batch in the epoch's permutation
+    int timestep;        // Updates since the optimizer state was reset, from 1, for Adam's bias correction
+};
+
+const int DISPATCH_PARAMS_BINDING = 0;  // Uniform buffer binding point of the block
+
+const glslField DISPATCH_PARAMS_FIELDS[] = {
+    {"int", "layerIdx"}, {"int", "stage"}, {"int", "batchSize"}, {"int", "neuronsStride"},
+    {"int", "maskStride"}, {"int", "nLayers"}, {"int", "lossLayer"}, {"int", "nWeights"}, {"int", "nBiases"},
+    {"float", "learningRate"}, {"float", "momentum"}, {"float", "adamBeta1"}, {"float", "adamBeta2"}, {"float", "adamEpsilon"},
+    {"int", "firstSample"}, {"int", "timestep"}
+};
+// Only 4 byte scalars, std140 packs them like C++ does
+static_assert(sizeof(dispatchParams) == 4 * 16, "DISPATCH_PARAMS_FIELDS is out of date");
+
+/// Generates the GLSL declaration of the parameter block, prepended to every shader
+/// The block has no instance name, so the shaders read its fields like plain uniforms.
+/// returns - the GLSL source
+inline std::string dispatchParamsGLSL(){
+    std::string glsl = "layout(std140, binding = " + std::to_string(DISPATCH_PARAMS_BINDING) + ") uniform DispatchParams {\n";
+    for(const glslField& field: DISPATCH_PARAMS_FIELDS)
+        glsl += std::string("    ") + field.type + " " + field.name + ";\n";
+    return glsl + "};\n\n";
+}
+
+/// Utility function to get the distance between two records of a parameter buffer
+/// alignment - GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, glBindBufferRange offsets have to be multiples of it
+inline int dispatchParamsStride(int alignment){
+    int size = (int)sizeof(dispatchParams);
+    return alignment > 0 ? (size + alignment - 1) / alignment * alignment : size;
+}
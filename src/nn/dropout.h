@@ -0,0 +1,44 @@
+#pragma once
+#include <cstdint>
+#include "rng.h"
+
+// Dropout masks are packed 64 neurons per word, bit j of word w keeps neuron 64w + j.
+// The same mask is applied by the forward epilogue and reused by the backward pass.
+
+/// Utility function to get the number of mask words of a layer
+inline int dropoutMaskWords(int neurons){
+    return (neurons + 63) / 64;
+}
+
+/// Utility function to check whether a neuron is kept by a packed mask
+inline bool dropoutKept(const uint64_t* mask, int neuron){
+    return (mask[neuron >> 6] >> (neuron & 63)) & 1;
+}
+
+/// Generates the packed dropout mask of one sample for one layer
+/// Every neuron draws one word from the dropout stream, keyed by the layer and the global sample index,
+/// the words are generated 64 at a time by the bulk fill and compared against the keep threshold.
+/// mask - output, dropoutMaskWords(neurons) long
+/// neurons - the number of neurons in the layer
+/// keep - the probability of keeping a neuron
+/// layer - index of the layer
+/// sample - global index of the sample (step * batch size + sample in batch)
+inline void dropoutMask(uint64_t* mask, int neurons, float keep, uint64_t seed, uint32_t layer, uint64_t sample){
+    int nWords = dropoutMaskWords(neurons);
+    if(keep >= 1.f){
+        for(int w=0; w < nWords; w++)
+            mask[w] = ~0ull;
+        return;
+    }
+
+    uint32_t threshold = (uint32_t)((double)keep * 4294967296.0);
+    uint32_t bits[64];
+    for(int w=0; w < nWords; w++){
+        int n = neurons - w * 64 < 64 ? neurons - w * 64 : 64;
+        rngFillUint(bits, n, seed, RNG_DROPOUT, layer, sample * (uint64_t)neurons + w * 64);
+        uint64_t word = 0;
+        for(int k=0; k < n; k++)
+            word |= (uint64_t)(bits[k] < threshold) << k;
+        mask[w] = word;
+    }
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include "half.h"
+
+// Row-major single precision matrix products, all of them accumulate into C
+// The loops are ordered so the innermost one streams contiguous memory and vectorizes,
+// and the shared dimension is blocked so a panel of B stays in cache across the rows of A.
+// gemm's B can be stored as bf16/fp16 (see half.h), halving the bytes streamed for the weights.
+
+const int GEMM_BLOCK_K = 128;
+
+/// c += a * b over a row, the row of B may be stored in 16 bits and is widened in registers
+inline void gemmAxpy(float a, const float* b, float* c, int n){
+    for(int j=0; j < n; j++)
+        c[j] += a * b[j];
+}
+
+inline void gemmAxpy(float a, const bf16* b, float* c, int n){
+    for(int j=0; j < n; j++)
+        c[j] += a * toFloat(b[j]);
+}
+
+inline void gemmAxpy(float a, const fp16* b, float* c, int n){
+    int j = 0;
+#ifdef __F16C__
+    __m256 va = _mm256_set1_ps(a);
+    for(; j + 8 <= n; j += 8){
+        __m256 vb = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(b + j)));
+        _mm256_storeu_ps(c + j, _mm256_add_ps(_mm256_loadu_ps(c + j), _mm256_mul_ps(va, vb)));
+    }
+#endif
+    for(; j < n; j++)
+        c[j] += a * toFloat(b[j]);
+}
+
+/// C += A * B
+/// M, N, K - C is M x N, A is M x K, B is K x N
+/// lda, ldb, ldc - distance in floats between consecutive rows
+/// B - float, bf16 or fp16, accumulation is always fp32
+template<class T>
+inline void gemm(int M, int N, int K, const float* A, int lda, const T* B, int ldb, float* C, int ldc){
+    for(int k0=0; k0 < K; k0 += GEMM_BLOCK_K){
+        int k1 = k0 + GEMM_BLOCK_K < K ? k0 + GEMM_BLOCK_K : K;
+        for(int m=0; m < M; m++){
+            float* c = C + m * ldc;
+            for(int k=k0; k < k1; k++)
+                gemmAxpy(A[m * lda + k], B + k * ldb, c, N);
+        }
+    }
+}
+
+/// C += A * B^T
+/// M, N, K - C is M x N, A is M x K, B is N x K
+inline void gemmNT(int M, int N, int K, const float* A, int lda, const float* B, int ldb, float* C, int ldc){
+    for(int m=0; m < M; m++){
+        const float* a = A + m * lda;
+        for(int n=0; n < N; n++){
+            const float* b = B + n * ldb;
+            float sum = 0.f;
+            for(int k=0; k < K; k++)
+                sum += a[k] * b[k];
+            C[m * ldc + n] += sum;
+        }
+    }
+}
+
+/// C += A^T * B
+/// M, N, K - C is M x N, A is K x M, B is K x N
+/// Rows of C whose A value is 0 are skipped, which makes the weight gradients of sparse inputs cheap.
+inline void gemmTN(int M, int N, int K, const float* A, int lda, const float* B, int ldb, float* C, int ldc){
+    for(int k=0; k < K; k++){
+        const float* b = B + k * ldb;
+        for(int m=0; m < M; m++){
+            float a = A[k * lda + m];
+            if(a == 0.f) continue;
+            float* c = C + m * ldc;
+            for(int n=0; n < N; n++)
+                c[n] += a * b[n];
+        }
+    }
+}
@@ -0,0 +1,332 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include "layers.h"
+#include "dense.h"
+#include "conv.h"
+#include "batchnorm.h"
+#include "dropout.h"
+#include "loss.h"
+
+// Layer graph, the single description of a network
+// Nodes form a chain from the input to the loss. Nodes that produce neurons (dense, conv, pool) become
+// forwardingLayers, the others (norm, activation, dropout) work in place on the neurons of the layer
+// before them and become that layer's epilogue. Lowering derives the layer table the shaders read,
+// the buffer sizes and the execution schedule, so a new node type only has to be taught here.
+
+enum nodeType { NODE_INPUT, NODE_DENSE, NODE_CONV, NODE_MAXPOOL, NODE_AVGPOOL, NODE_NORM, NODE_ACTIVATION, NODE_DROPOUT, NODE_LOSS };
+const char* const NODE_NAMES[] = {"input", "dense", "conv", "maxpool", "avgpool", "norm", "activation", "dropout", "loss"};
+
+struct graphNode{
+    nodeType type;
+    shape out;          // Shape of the node's output
+    int kernel;         // Conv & pool window
+    int stride;
+    int padding;
+    activation act;     // NODE_ACTIVATION
+    float rate;         // NODE_DROPOUT drop probability
+    int layer;          // Set by lowering, index of the layer whose neurons the node writes (-1 for the input)
+};
+
+struct layerGraph{
+    std::vector<graphNode> nodes;
+};
+
+/// Utility function to append a node, the output shape defaults to the previous node's
+inline graphNode& graphAppend(layerGraph& graph, nodeType type){
+    graphNode node = {type, {0, 0, 0}, 1, 1, 0, ACT_NONE, 0.f, -1};
+    if(!graph.nodes.empty())
+        node.out = graph.nodes.back().out;
+    graph.nodes.push_back(node);
+    return graph.nodes.back();
+}
+
+inline void graphInput(layerGraph& graph, shape in){
+    graphAppend(graph, NODE_INPUT).out = in;
+}
+
+inline void graphDense(layerGraph& graph, int neurons){
+    graphAppend(graph, NODE_DENSE).out = {neurons, 1, 1};
+}
+
+inline void graphConv(layerGraph& graph, int channels, int kernel, int stride = 1, int padding = 0){
+    graphNode& node = graphAppend(graph, NODE_CONV);
+    node.out = {channels, windowOutputSize(node.out.height, kernel, stride, padding), windowOutputSize(node.out.width, kernel, stride, padding)};
+    node.kernel = kernel; node.stride = stride; node.padding = padding;
+}
+
+/// type - NODE_MAXPOOL or NODE_AVGPOOL
+inline void graphPool(layerGraph& graph, nodeType type, int kernel, int stride){
+    graphNode& node = graphAppend(graph, type);
+    node.out.height = windowOutputSize(node.out.height, kernel, stride, 0);
+    node.out.width = windowOutputSize(node.out.width, kernel, stride, 0);
+    node.kernel = kernel; node.stride = stride;
+}
+
+inline void graphNorm(layerGraph& graph){
+    graphAppend(graph, NODE_NORM);
+}
+
+inline void graphActivation(layerGraph& graph, activation act){
+    graphAppend(graph, NODE_ACTIVATION).act = act;
+}
+
+/// rate - probability of dropping a neuron while training
+inline void graphDropout(layerGraph& graph, float rate){
+    graphAppend(graph, NODE_DROPOUT).rate = rate;
+}
+
+/// Softmax + cross-entropy over the previous layer's outputs
+inline void graphLoss(layerGraph& graph){
+    graphAppend(graph, NODE_LOSS);
+}
+
+struct networkLayout{
+    std::vector<forwardingLayer> layers;
+    std::vector<int> schedule;   // Node indices in forward order, the backward pass walks it in reverse
+    int nNeurons;                // Per sample, also the distance between consecutive samples
+    int nWeights;
+    int nBiases;
+    int nNormParams;
+    int maskStride;              // Dropout mask words per sample
+    int scratchSize;             // Floats needed by the conv kernels
+    int inputNeurons;
+    int lossLayer;               // Layer whose outputs are the logits, -1 without a loss node
+};
+
+/// Utility function to report a graph that cannot be lowered
+inline bool graphError(int nodeIdx, const graphNode& node, const char* reason){
+    std::cerr << "ERROR::GRAPH_LOWERING_FAILED\nNode " << nodeIdx << " (" << NODE_NAMES[node.type] << "): " << reason << std::endl;
+    return false;
+}
+
+/// Lowers a graph into the flat layer table, buffer sizes & schedule
+/// Epilogue nodes have to follow their layer in the order norm, activation, dropout (each at most once),
+/// the order the kernels apply them in.
+/// graph - the graph, each node's layer is filled in
+/// layout - output
+/// returns - false if the graph cannot be lowered (the reason is printed)
+inline bool lowerGraph(layerGraph& graph, networkLayout& layout){
+    layout = networkLayout{};
+    layout.lossLayer = -1;
+    if(graph.nodes.empty() || graph.nodes[0].type != NODE_INPUT)
+        return graphError(0, graph.nodes.empty() ? graphNode{} : graph.nodes[0], "the graph has to start with an input");
+
+    const graphNode& input = graph.nodes[0];
+    layout.inputNeurons = layout.nNeurons = input.out.channels * input.out.height * input.out.width;
+    int epilogueStage = 3;  // 0 right after a layer, 1 after norm, 2 after activation, 3 after dropout or with no layer to attach to
+
+    for(int n=1; n < (int)graph.nodes.size(); n++){
+        graphNode& node = graph.nodes[n];
+        const graphNode& prev = graph.nodes[n - 1];
+        int prevNeurons = prev.out.channels * prev.out.height * prev.out.width;
+
+        if(node.type == NODE_DENSE || node.type == NODE_CONV || node.type == NODE_MAXPOOL || node.type == NODE_AVGPOOL){
+            if(layout.lossLayer >= 0)
+                return graphError(n, node, "nothing can follow the loss");
+            if(node.out.height <= 0 || node.out.width <= 0)
+                return graphError(n, node, "the window does not fit in the input");
+
+            forwardingLayer layer = {};
+            int dstNeurons = node.out.channels * node.out.height * node.out.width;
+            int weights = 0, biases = 0;
+            if(node.type == NODE_DENSE){
+                layer.type = LAYER_DENSE;
+                weights = prevNeurons * dstNeurons;
+                biases = dstNeurons;
+            }
+            else if(node.type == NODE_CONV){
+                layer.type = LAYER_CONV;
+                weights = node.out.channels * prev.out.channels * node.kernel * node.kernel;
+                biases = node.out.channels;
+            }
+            else
+                layer.type = node.type == NODE_MAXPOOL ? LAYER_MAXPOOL : LAYER_AVGPOOL;
+
+            layer.neurons = {layout.nNeurons, layout.nNeurons + dstNeurons};
+            layer.weights = {layout.nWeights, layout.nWeights + weights};
+            layer.biases = {layout.nBiases, layout.nBiases + biases};
+            layer.srcNeurons = prevNeurons;
+            layer.dstNeurons = dstNeurons;
+            layer.src = node.type == NODE_DENSE ? shape{prevNeurons, 1, 1} : prev.out;
+            layer.dst = node.out;
+            layer.kernel = node.kernel;
+            layer.stride = node.stride;
+            layer.padding = node.padding;
+            layer.norm = {layout.nNormParams, layout.nNormParams};
+            layer.activation = ACT_NONE;
+            layer.maskBegin = -1;
+            layer.keep = 1.f;
+
+            if(layer.type == LAYER_CONV){
+                int scratch = convScratchSize(layer);
+                layout.scratchSize = scratch > layout.scratchSize ? scratch : layout.scratchSize;
+            }
+
+            layout.nNeurons += dstNeurons;
+            layout.nWeights += weights;
+            layout.nBiases += biases;
+            layout.layers.push_back(layer);
+            epilogueStage = layer.type == LAYER_DENSE || layer.type == LAYER_CONV ? 0 : 2;  // Pools only take dropout
+        }
+        else if(node.type == NODE_NORM){
+            if(epilogueStage > 0)
+                return graphError(n, node, "normalization has to directly follow a dense or conv layer");
+            forwardingLayer& layer = layout.layers.back();
+            layer.norm = {layout.nNormParams, layout.nNormParams + batchNormParams(layer.dst.channels)};
+            layout.nNormParams = layer.norm.end;
+            epilogueStage = 1;
+        }
+        else if(node.type == NODE_ACTIVATION){
+            if(epilogueStage > 1)
+                return graphError(n, node, "activations have to follow a dense/conv layer or its normalization");
+            layout.layers.back().activation = node.act;
+            epilogueStage = 2;
+        }
+        else if(node.type == NODE_DROPOUT){
+            if(epilogueStage > 2)
+                return graphError(n, node, "dropout has to follow a layer");
+            forwardingLayer& layer = layout.layers.back();
+            layer.maskBegin = layout.maskStride;
+            layer.keep = 1.f - node.rate;
+            layout.maskStride += dropoutMaskWords(layer.dstNeurons);
+            epilogueStage = 3;
+        }
+        else if(node.type == NODE_LOSS){
+            if(layout.layers.empty() || layout.lossLayer >= 0)
+                return graphError(n, node, "the loss needs a single layer of logits before it");
+            layout.lossLayer = (int)layout.layers.size() - 1;
+            epilogueStage = 3;
+        }
+        else
+            return graphError(n, node, "only the first node can be an input");
+
+        node.layer = (int)layout.layers.size() - 1;
+        layout.schedule.push_back(n);
+    }
+
+    return true;
+}
+
+// Everything a CPU pass reads & writes, sized from the layout
+struct networkBuffers{
+    float* neurons;          // [batch x nNeurons]
+    float* deltas;           // Same layout as the neurons
+    float* weights;
+    float* biases;
+    float* norms;            // Batchnorm parameters
+    float* weightGradients;
+    float* biasGradients;
+    float* normGradients;    // Same layout as the norms
+    uint64_t* masks;         // [batch x maskStride]
+    float* normCache;        // Normalized values, same layout as the neurons
+    float* normInvStd;       // nNormParams / 4
+    float* scratch;          // scratchSize
+    const int* targets;      // Class of each sample
+    float* losses;           // Loss of each sample
+};
+
+/// Runs the schedule forward over a batch, one node at a time
+/// graph - the lowered graph
+/// layout - its layout
+/// buffers - the network's buffers, the input neurons of every sample have to be filled in
+/// batch - the number of samples
+/// training - whether dropout & batch statistics are used
+/// seed - keys the dropout masks
+/// firstSample - global index of the batch's first sample, keys the dropout masks
+/// returns - the mean loss of the batch (0 without a loss node)
+inline float graphForward(const layerGraph& graph, const networkLayout& layout, const networkBuffers& buffers,
+                          int batch, bool training, uint64_t seed, uint64_t firstSample){
+    int stride = layout.nNeurons;
+    float loss = 0.f;
+    for(int n: layout.schedule){
+        const graphNode& node = graph.nodes[n];
+        const forwardingLayer& layer = layout.layers[node.layer];
+        float* out = buffers.neurons + layer.neurons.begin;
+
+        switch(node.type){
+            case NODE_DENSE:
+                denseForward(layer, buffers.weights, buffers.biases, buffers.neurons, batch, stride, ACT_NONE);
+                break;
+            case NODE_CONV:
+                convForward(layer, buffers.weights, buffers.biases, buffers.neurons, batch, stride, ACT_NONE, buffers.scratch);
+                break;
+            case NODE_MAXPOOL:
+            case NODE_AVGPOOL:
+                poolForward(layer, buffers.neurons, batch, stride);
+                break;
+            case NODE_NORM:
+                batchNormForward(layer, buffers.norms + layer.norm.begin, buffers.neurons, batch, stride, ACT_NONE, training,
+                                 buffers.normCache, buffers.normInvStd + layer.norm.begin / 4);
+                break;
+            case NODE_ACTIVATION:
+                for(int b=0; b < batch; b++)
+                    activationForward(out + b * stride, layer.dstNeurons, node.act, nullptr, 1.f);
+                break;
+            case NODE_DROPOUT:
+                if(!training) break;
+                for(int b=0; b < batch; b++){
+                    uint64_t* mask = buffers.masks + b * layout.maskStride + layer.maskBegin;
+                    dropoutMask(mask, layer.dstNeurons, layer.keep, seed, node.layer, firstSample + b);
+                    activationForward(out + b * stride, layer.dstNeurons, ACT_NONE, mask, layer.keep);
+                }
+                break;
+            case NODE_LOSS:
+                loss = softmaxCrossEntropy(out, stride, buffers.targets, batch, layer.dstNeurons,
+                                           buffers.deltas + layer.neurons.begin, stride, buffers.losses);
+                break;
+            default:
+                break;
+        }
+    }
+    return loss;
+}
+
+/// Runs the schedule backward over a batch, after graphForward with training on
+/// The loss node already left dLoss/dLogits in the deltas, gradients are accumulated.
+inline void graphBackward(const layerGraph& graph, const networkLayout& layout, const networkBuffers& buffers, int batch){
+    int stride = layout.nNeurons;
+    for(int s=(int)layout.schedule.size() - 1; s >= 0; s--){
+        const graphNode& node = graph.nodes[layout.schedule[s]];
+        const forwardingLayer& layer = layout.layers[node.layer];
+        bool propagate = layer.neurons.begin - layer.srcNeurons > 0;  // The input layer needs no deltas
+        float* out = buffers.neurons + layer.neurons.begin;
+        float* d = buffers.deltas + layer.neurons.begin;
+
+        switch(node.type){
+            case NODE_DENSE:
+                denseBackward(layer, buffers.weights, buffers.neurons, buffers.deltas, buffers.weightGradients, buffers.biasGradients,
+                              batch, stride, ACT_NONE, propagate);
+                break;
+            case NODE_CONV:
+                convBackward(layer, buffers.weights, buffers.neurons, buffers.deltas, buffers.weightGradients, buffers.biasGradients,
+                             batch, stride, ACT_NONE, propagate, buffers.scratch);
+                break;
+            case NODE_MAXPOOL:
+            case NODE_AVGPOOL:
+                poolBackward(layer, buffers.neurons, buffers.deltas, batch, stride);
+                break;
+            case NODE_NORM:
+                batchNormBackward(layer, buffers.norms + layer.norm.begin, buffers.normGradients + layer.norm.begin, buffers.neurons,
+                                  buffers.deltas, batch, stride, ACT_NONE, buffers.normCache, buffers.normInvStd + layer.norm.begin / 4);
+                break;
+            case NODE_ACTIVATION:
+                for(int b=0; b < batch; b++)
+                    activationBackward(d + b * stride, out + b * stride, layer.dstNeurons, node.act, nullptr, 1.f);
+                break;
+            case NODE_DROPOUT:
+                // Masks the deltas and undoes the scaling of the outputs, so the nodes before see their own outputs
+                for(int b=0; b < batch; b++){
+                    const uint64_t* mask = buffers.masks + b * layout.maskStride + layer.maskBegin;
+                    for(int j=0; j < layer.dstNeurons; j++){
+                        bool kept = dropoutKept(mask, j);
+                        d[b * stride + j] = kept ? d[b * stride + j] / layer.keep : 0.f;
+                        out[b * stride + j] = kept ? out[b * stride + j] * layer.keep : 0.f;
+                    }
+                }
+                break;
+            default:
+                break;
+        }
+    }
+}
@@ -0,0 +1,116 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+// 16 bit float storage, values are only ever computed on as fp32
+// bf16 keeps fp32's exponent range with an 8 bit mantissa, fp16 (IEEE half) has a 5 bit exponent
+// and an 11 bit mantissa. fp16 conversions use the F16C instructions when compiled with -mf16c,
+// without them they are emulated bit by bit and bf16 (a shift) is the faster choice.
+
+enum precision { PRECISION_FP32, PRECISION_BF16, PRECISION_FP16 };
+const char* const PRECISION_NAMES[] = {"fp32", "bf16", "fp16"};
+
+// Wrapped so the kernels can overload on the storage type
+struct bf16{
+    uint16_t bits;
+};
+
+struct fp16{
+    uint16_t bits;
+};
+
+inline float toFloat(float value){
+    return value;
+}
+
+inline float toFloat(bf16 value){
+    uint32_t bits = (uint32_t)value.bits << 16;
+    float result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+/// Rounds to the nearest bf16, ties to even (NaNs stay NaNs)
+inline bf16 toBf16(float value){
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    if((bits & 0x7fffffffu) > 0x7f800000u)
+        return {(uint16_t)((bits >> 16) | 0x40)};
+    bits += 0x7fffu + ((bits >> 16) & 1);
+    return {(uint16_t)(bits >> 16)};
+}
+
+inline float toFloat(fp16 value){
+#ifdef __F16C__
+    return _cvtsh_ss(value.bits);
+#else
+    uint32_t sign = (uint32_t)(value.bits & 0x8000) << 16;
+    uint32_t exponent = (value.bits >> 10) & 0x1f;
+    uint32_t mantissa = value.bits & 0x3ff;
+    uint32_t bits;
+    if(exponent == 0x1f)
+        bits = sign | 0x7f800000u | (mantissa << 13);              // Inf & NaN
+    else if(exponent != 0)
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13); // Normal, rebias 15 -> 127
+    else if(mantissa == 0)
+        bits = sign;
+    else{
+        // Subnormal, normalize the mantissa
+        exponent = 113;
+        while(!(mantissa & 0x400)){
+            mantissa <<= 1;
+            exponent--;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+    }
+    float result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+#endif
+}
+
+/// Rounds to the nearest fp16, ties to even, out of range values become infinities
+inline fp16 toFp16(float value){
+#ifdef __F16C__
+    return {_cvtss_sh(value, _MM_FROUND_TO_NEAREST_INT)};
+#else
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    uint16_t sign = (uint16_t)((bits >> 16) & 0x8000);
+    uint32_t magnitude = bits & 0x7fffffffu;
+    if(magnitude > 0x7f800000u)
+        return {(uint16_t)(sign | 0x7e00)};   // NaN
+    if(magnitude >= 0x477ff000u)
+        return {(uint16_t)(sign | 0x7c00)};   // Rounds past the largest half
+    if(magnitude < 0x38800000u){
+        // Subnormal half, shift the implicit 1 in and round on the bits shifted out
+        if(magnitude < 0x33000000u)
+            return {sign};
+        uint32_t exponent = magnitude >> 23;
+        uint32_t mantissa = (magnitude & 0x7fffff) | 0x800000;
+        int shift = 126 - (int)exponent;
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t midpoint = 1u << (shift - 1);
+        if(rest > midpoint || (rest == midpoint && (half & 1)))
+            half++;
+        return {(uint16_t)(sign | half)};
+    }
+    magnitude += 0xfffu + ((magnitude >> 13) & 1);
+    return {(uint16_t)(sign | ((magnitude - 0x38000000u) >> 13))};
+#endif
+}
+
+/// Converts an fp32 array to 16 bit storage
+inline void toHalf(const float* in, bf16* out, int length){
+    for(int i=0; i < length; i++)
+        out[i] = toBf16(in[i]);
+}
+
+inline void toHalf(const float* in, fp16* out, int length){
+    for(int i=0; i < length; i++)
+        out[i] = toFp16(in[i]);
+}
@@ -0,0 +1,115 @@
+#pragma once
+#include <string>
+
+enum layerType { LAYER_DENSE, LAYER_CONV, LAYER_MAXPOOL, LAYER_AVGPOOL };
+const char* const LAYER_TYPE_NAMES[] = {"LAYER_DENSE", "LAYER_CONV", "LAYER_MAXPOOL", "LAYER_AVGPOOL"};
+
+enum activation { ACT_NONE, ACT_SOFTPLUS };
+const char* const ACTIVATION_NAMES[] = {"ACT_NONE", "ACT_SOFTPLUS"};
+
+struct range{
+    int begin;
+    int end;
+};
+
+// Neurons of conv & pool layers are laid out channel by channel, each channel row by row
+struct shape{
+    int channels;
+    int height;
+    int width;
+};
+
+// Mirrored by the shaders through forwardingLayerGLSL(), keep FORWARDING_LAYER_FIELDS in sync
+struct forwardingLayer{
+    range neurons;
+    range weights;    // Dense: [src][dst], conv: [dst channel][src channel][kernel][kernel]
+    range biases;     // Dense: one per neuron, conv: one per channel
+    int srcNeurons;   // Neurons in the previous (source) layer
+    int dstNeurons;   // Neurons in the current (destination) layer
+    int type;         // layerType
+    shape src;        // Dense layers are {neurons, 1, 1}
+    shape dst;
+    int kernel;       // Conv & pool window size (square)
+    int stride;
+    int padding;      // Zero padding on every side (conv only)
+    // Epilogue, applied in this order to the layer's outputs
+    range norm;       // Batchnorm parameters (gamma, beta, mean, variance), empty if not normalized
+    int activation;   // activation
+    int maskBegin;    // First dropout mask word of the layer in a sample's masks, -1 if no dropout
+    float keep;       // Dropout keep probability
+};
+
+/// Utility function to get the output size of a conv/pool window along one dimension
+inline int windowOutputSize(int in, int kernel, int stride, int padding){
+    return (in + 2 * padding - kernel) / stride + 1;
+}
+
+struct glslField{
+    const char* type;
+    const char* name;
+};
+
+const glslField FORWARDING_LAYER_FIELDS[] = {
+    {"Range", "neurons"}, {"Range", "weights"}, {"Range", "biases"},
+    {"int", "srcNeurons"}, {"int", "dstNeurons"}, {"int", "type"},
+    {"Shape", "src"}, {"Shape", "dst"},
+    {"int", "kernel"}, {"int", "stride"}, {"int", "padding"},
+    {"Range", "norm"}, {"int", "activation"}, {"int", "maskBegin"}, {"float", "keep"}
+};
+// Every field is made of 4 byte scalars, so the std430 layout matches the C++ one without padding
+static_assert(sizeof(forwardingLayer) == 4 * (3 * 2 + 3 + 2 * 3 + 3 + 2 + 3), "FORWARDING_LAYER_FIELDS is out of date");
+
+/// Generates the GLSL declarations of the layer table & its enums, prepended to every shader
+/// returns - the GLSL source
+inline std::string forwardingLayerGLSL(){
+    std::string glsl = "struct Range {\n    int begin;\n    int end;\n};\n\n"
+                       "struct Shape {\n    int channels;\n    int height;\n    int width;\n};\n\n"
+                       "struct ForwardingLayer {\n";
+    for(const glslField& field: FORWARDING_LAYER_FIELDS)
+        glsl += std::string("    ") + field.type + " " + field.name + ";\n";
+    glsl += "};\n\n";
+
+    for(int i=0; i <= LAYER_AVGPOOL; i++)
+        glsl += std::string("const int ") + LAYER_TYPE_NAMES[i] + " = " + std::to_string(i) + ";\n";
+    for(int i=0; i <= ACT_SOFTPLUS; i++)
+        glsl += std::string("const int ") + ACTIVATION_NAMES[i] + " = " + std::to_string(i) + ";\n";
+    return glsl;
+}
+
+/// Generates the epilogue shared by the forward shaders (feedforward.comp, dense_tiled.comp, network_fused.comp):
+/// batchnorm with the running statistics, activation & inverted dropout, the GPU side of activationForward (nn/dense.h)
+/// Declares the dropout masks & norms buffers it reads, and the training uniform. Needs maskStride from DispatchParams.
+/// returns - the GLSL source
+inline std::string forwardEpilogueGLSL(){
+    return R"(
+layout(std430, binding = 9) buffer DropoutMasksBuffer { uint masks[]; };  // Packed 64 neurons per uint pair, [batch x maskStride] pairs
+layout(std430, binding = 10) buffer NormsBuffer { float norms[]; };       // Batchnorm gamma, beta, mean & variance per layer
+uniform bool training = true;  // Dropout only applies while training
+
+const float BN_EPSILON = 1e-5;
+
+// x is the pre-activation of neuron j of the layer, for the sample sampleIdx
+float epilogue(ForwardingLayer layer, int sampleIdx, int j, float x) {
+    int channels = layer.norm.end - layer.norm.begin;
+    if(channels > 0){
+        channels /= 4;
+        int c = j / (layer.dstNeurons / channels);
+        float gamma = norms[layer.norm.begin + c], beta = norms[layer.norm.begin + channels + c];
+        float mean = norms[layer.norm.begin + 2 * channels + c], var = norms[layer.norm.begin + 3 * channels + c];
+        x = gamma * (x - mean) * inversesqrt(var + BN_EPSILON) + beta;
+    }
+
+    // The logits are left raw, softmax is fused with the loss in loss.comp.
+    // exp overflows past ~88, softplus(x) is x to float precision well before that
+    float y = layer.activation == ACT_SOFTPLUS ? (x > 20.f ? x : log(1.f + exp(x))) : x;
+
+    // Inverted dropout, kept neurons are scaled so the expected activation is unchanged
+    if(training && layer.maskBegin >= 0){
+        uint word = masks[2 * (sampleIdx * maskStride + layer.maskBegin) + j / 32];
+        y = ((word >> (j % 32)) & 1u) != 0u ? y / layer.keep : 0.f;
+    }
+    return y;
+}
+
+)";
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <cmath>
+
+/// Fused softmax + cross-entropy head for a batch of samples
+/// The log-sum-exp is shifted by the largest logit so exp() never overflows, and the output
+/// delta (softmax - one-hot) is written in the same pass, so backprop can start straight away.
+/// logits - first logit of the first sample, samples are logitsStride floats apart
+/// logitsStride - distance in floats between the logits of consecutive samples
+/// targets - class index of each sample (batch long)
+/// batch - the number of samples
+/// classes - the number of output neurons
+/// delta - output for dLoss/dLogit of each sample, samples are deltaStride floats apart
+/// deltaStride - distance in floats between the deltas of consecutive samples
+/// losses - optional output for the loss of each sample (batch long)
+/// returns - the mean cross-entropy loss of the batch
+inline float softmaxCrossEntropy(const float* logits, int logitsStride, const int* targets, int batch, int classes,
+                                 float* delta, int deltaStride, float* losses = nullptr){
+    float totalLoss = 0.f;
+    for(int b=0; b < batch; b++){
+        const float* z = logits + b * logitsStride;
+        float* d = delta + b * deltaStride;
+
+        float maxLogit = z[0];
+        for(int c=1; c < classes; c++)
+            maxLogit = std::fmax(maxLogit, z[c]);
+
+        // Keep the shifted exponentials in the delta so they are not recomputed
+        float expSum = 0.f;
+        for(int c=0; c < classes; c++){
+            d[c] = std::exp(z[c] - maxLogit);
+            expSum += d[c];
+        }
+
+        float loss = maxLogit + std::log(expSum) - z[targets[b]];
+        float invExpSum = 1.f / expSum;
+        for(int c=0; c < classes; c++)
+            d[c] = d[c] * invExpSum - (c == targets[b] ? 1.f : 0.f);
+
+        if(losses)
+            losses[b] = loss;
+        totalLoss += loss;
+    }
+
+    return batch > 0 ? totalLoss / batch : 0.f;
+}
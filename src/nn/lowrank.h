@@ -0,0 +1,189 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+#include "plan.h"
+
+// Offline low-rank factorization of trained dense layers
+// A dense layer's [src x dst] weights W are replaced by the truncated SVD W ~ (U * S) * V^T, split into two
+// thin dense layers: src -> rank with no epilogue & biases starting at 0 (they train like any other), then
+// rank -> dst with the original biases & epilogue.
+// That costs rank * (src + dst) multiply-adds instead of src * dst, and needs no retraining.
+
+/// Singular value decomposition of a row-major m x n matrix by one-sided Jacobi rotations
+/// The columns are rotated pairwise until they are orthogonal, then W * V = U * S column by column.
+/// W - the matrix
+/// scaledU - output, n columns of m values (column-major), column k is U_k * s_k
+/// V - output, n columns of n values (column-major)
+/// singular - output, n singular values
+/// Columns are sorted by decreasing singular value.
+inline void svdJacobi(const float* W, int m, int n, std::vector<double>& scaledU, std::vector<double>& V, std::vector<double>& singular){
+    std::vector<double> G(n * m), R(n * n, 0.0);
+    for(int i=0; i < m; i++)
+        for(int j=0; j < n; j++)
+            G[j * m + i] = W[i * n + j];
+    for(int j=0; j < n; j++)
+        R[j * n + j] = 1.0;
+
+    const double tolerance = 1e-12;
+    for(int sweep=0; sweep < 60; sweep++){
+        bool rotated = false;
+        for(int p=0; p < n - 1; p++)
+            for(int q=p + 1; q < n; q++){
+                double* gp = G.data() + p * m;
+                double* gq = G.data() + q * m;
+                double alpha = 0.0, beta = 0.0, gamma = 0.0;
+                for(int i=0; i < m; i++){
+                    alpha += gp[i] * gp[i];
+                    beta += gq[i] * gq[i];
+                    gamma += gp[i] * gq[i];
+                }
+                if(std::fabs(gamma) <= tolerance * std::sqrt(alpha * beta))
+                    continue;
+                rotated = true;
+                double zeta = (beta - alpha) / (2.0 * gamma);
+                double t = (zeta >= 0.0 ? 1.0 : -1.0) / (std::fabs(zeta) + std::sqrt(1.0 + zeta * zeta));
+                double c = 1.0 / std::sqrt(1.0 + t * t), s = c * t;
+                for(int i=0; i < m; i++){
+                    double a = gp[i], b = gq[i];
+                    gp[i] = c * a - s * b;
+                    gq[i] = s * a + c * b;
+                }
+                double* rp = R.data() + p * n;
+                double* rq = R.data() + q * n;
+                for(int i=0; i < n; i++){
+                    double a = rp[i], b = rq[i];
+                    rp[i] = c * a - s * b;
+                    rq[i] = s * a + c * b;
+                }
+            }
+        if(!rotated) break;
+    }
+
+    std::vector<double> norms(n);
+    std::vector<int> order(n);
+    for(int j=0; j < n; j++){
+        double sum = 0.0;
+        for(int i=0; i < m; i++)
+            sum += G[j * m + i] * G[j * m + i];
+        norms[j] = std::sqrt(sum);
+        order[j] = j;
+    }
+    std::sort(order.begin(), order.end(), [&](int a, int b){ return norms[a] > norms[b]; });
+
+    scaledU.resize(n * m);
+    V.resize(n * n);
+    singular.resize(n);
+    for(int k=0; k < n; k++){
+        std::copy_n(G.data() + order[k] * m, m, scaledU.data() + k * m);
+        std::copy_n(R.data() + order[k] * n, n, V.data() + k * n);
+        singular[k] = norms[order[k]];
+    }
+}
+
+/// Utility function to get the smallest rank keeping a fraction of the squared singular values' sum
+inline int energyRank(const std::vector<double>& singular, float energy){
+    double total = 0.0, kept = 0.0;
+    for(double s: singular)
+        total += s * s;
+    for(int k=0; k < (int)singular.size(); k++){
+        kept += singular[k] * singular[k];
+        if(kept >= energy * total)
+            return k + 1;
+    }
+    return (int)singular.size();
+}
+
+/// Factorizes one dense node of a lowered graph into two thin dense layers
+/// The graph is rewritten & lowered again, the weights & biases are repacked into the new layout.
+/// The other buffers (neurons, gradients...) & any compiled plan have to be rebuilt from the new layout.
+/// graph, layout - the network, updated
+/// weights, biases - the network's parameters, updated
+/// nodeIdx - the dense node
+/// rank - rank to keep, 0 to pick it from the energy instead
+/// energy - fraction of the squared singular values to keep when rank is 0
+/// returns - the rank used, 0 if the layer was left alone because factorizing it would not save work or the
+///           rewritten graph would not lower (the graph & layout are restored then)
+inline int factorizeDense(layerGraph& graph, networkLayout& layout, std::vector<float>& weights, std::vector<float>& biases,
+                          int nodeIdx, int rank, float energy){
+    if(graph.nodes[nodeIdx].type != NODE_DENSE)
+        return 0;
+    int layerIdx = graph.nodes[nodeIdx].layer;
+    const forwardingLayer old = layout.layers[layerIdx];
+    int m = old.srcNeurons, n = old.dstNeurons;
+
+    std::vector<double> scaledU, V, singular;
+    svdJacobi(weights.data() + old.weights.begin, m, n, scaledU, V, singular);
+    if(rank <= 0)
+        rank = energyRank(singular, energy);
+    rank = rank < n ? rank : n;
+    if(rank * (m + n) >= m * n)
+        return 0;
+
+    // src -> rank, inserted before the node so the original epilogue nodes stay behind the second layer
+    graphNode thin = graph.nodes[nodeIdx];
+    thin.out = {rank, 1, 1};
+    graph.nodes.insert(graph.nodes.begin() + nodeIdx, thin);
+    networkLayout oldLayout = layout;
+    if(!lowerGraph(graph, layout)){
+        // The failed lowering may have renumbered the nodes' layers, lowering the original graph again restores both
+        graph.nodes.erase(graph.nodes.begin() + nodeIdx);
+        lowerGraph(graph, layout);
+        return 0;
+    }
+
+    std::vector<float> newWeights(layout.nWeights), newBiases(layout.nBiases);
+    for(int l=0; l < (int)layout.layers.size(); l++){
+        const forwardingLayer& layer = layout.layers[l];
+        float* w = newWeights.data() + layer.weights.begin;
+        float* b = newBiases.data() + layer.biases.begin;
+        if(l == layerIdx){
+            // [src][rank] = U * S
+            for(int i=0; i < m; i++)
+                for(int k=0; k < rank; k++)
+                    w[i * rank + k] = (float)scaledU[k * m + i];
+            std::fill(b, b + rank, 0.f);  // W was all there was, so the thin layer starts without an offset
+        }
+        else if(l == layerIdx + 1){
+            // [rank][dst] = V^T
+            for(int k=0; k < rank; k++)
+                for(int j=0; j < n; j++)
+                    w[k * n + j] = (float)V[k * n + j];
+            std::copy(biases.begin() + old.biases.begin, biases.begin() + old.biases.end, b);
+        }
+        else{
+            const forwardingLayer& source = oldLayout.layers[l < layerIdx ? l : l - 1];
+            std::copy(weights.begin() + source.weights.begin, weights.begin() + source.weights.end, w);
+            std::copy(biases.begin() + source.biases.begin, biases.begin() + source.biases.end, b);
+        }
+    }
+    weights.swap(newWeights);
+    biases.swap(newBiases);
+
+    std::cout << "Factorized layer " << layerIdx << " (" << m << "x" << n << ") at rank " << rank
+              << ": " << m * n << " -> " << rank * (m + n) << " multiply-adds per sample" << std::endl;
+    return rank;
+}
+
+/// Factorizes every dense layer where it saves work, and prints the accuracy before & after
+/// The network is rebuilt in place: graph, layout, plan & storage (sized for one sample) all change.
+/// data - samples to measure the accuracy on
+/// returns - the number of layers factorized
+inline int lowRankFactorize(layerGraph& graph, networkLayout& layout, executionPlan& plan, planStorage& storage,
+                            const dataset& data, int rank, float energy){
+    networkBuffers buffers = allocatePlanBuffers(layout, 1, storage, true);
+    float before = planAccuracy(plan, layout, buffers, data);
+
+    int factorized = 0;
+    for(int n=(int)graph.nodes.size() - 1; n > 0; n--)
+        factorized += factorizeDense(graph, layout, storage.weights, storage.biases, n, rank, energy) > 0;
+
+    compilePlan(graph, layout, plan, plan.weightPrecision);
+    buffers = allocatePlanBuffers(layout, 1, storage, true);
+    planSyncWeights(layout, plan, buffers.weights);
+    float after = planAccuracy(plan, layout, buffers, data);
+    std::cout << "Low-rank factorization of " << factorized << " layers, accuracy " << 100.f * before << "% -> "
+              << 100.f * after << "% (" << 100.f * (after - before) << ")" << std::endl;
+    return factorized;
+}
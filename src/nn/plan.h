@@ -0,0 +1,344 @@
+#pragma once
+#include <algorithm>
+#include <vector>
+#include "graph.h"
+#include "tape.h"
+#include "dataset.h"
+
+// Compiled execution plan of a lowered graph
+// graphForward runs one pass over the activations per node. The plan instead fuses each layer with its
+// epilogue (dense/conv -> bias -> norm -> activation -> dropout) into a single op, so the outputs are
+// written once by the layer's kernel and finished while still in cache. The plan and its storage are
+// built once after lowering and replayed every step. The backward pass replays a tape recorded by the
+// forward one, whose arena stops growing after the first step, so steady state steps never allocate.
+
+enum planOpType { OP_DENSE, OP_CONV, OP_POOL, OP_LOSS };
+const char* const PLAN_OP_NAMES[] = {"dense", "conv", "pool", "loss"};
+
+struct planOp{
+    planOpType type;
+    int layer;          // Index into the layout's layers
+    bool norm;          // Batchnorm between the layer and its activation
+    bool dropout;       // Dropout masks are generated & applied while training
+    activation act;
+    bool sparse;        // Dense layer running on the CSR copy of its weights (see planSparsify)
+    bool sparseInput;   // Dense layer reading the network's input, skips the input neurons that are 0 (see planSparsifyInput)
+};
+
+struct executionPlan{
+    std::vector<planOp> ops;
+    std::vector<float> transposedWeights;   // Dense layers' weights stored [dst][src] for the backward pass
+    precision weightPrecision;              // Storage the dense layers' forward pass reads the weights from
+    std::vector<bf16> bf16Weights;          // 16 bit copies of the fp32 master weights, only the one in use is sized
+    std::vector<fp16> fp16Weights;
+    std::vector<csrMatrix> sparseWeights;   // Per layer, only built for the sparse ops
+    std::vector<float> pruneMask;           // [nWeights] 0 for the pruned weights, empty until planPrune ran
+};
+
+// Owns every buffer a plan touches, sized once from the layout so replaying the plan never allocates
+struct planStorage{
+    std::vector<float> neurons, deltas, weights, biases, norms, weightGradients, biasGradients, normGradients;
+    std::vector<float> normCache, normInvStd, scratch, losses;
+    std::vector<uint64_t> masks;
+    std::vector<int> targets;
+};
+
+/// Sizes a plan's storage for a batch
+/// keepParameters - leave the weights, biases & batchnorm parameters as they are (already laid out for the layout)
+/// returns - views of the storage, valid until it is resized again
+inline networkBuffers allocatePlanBuffers(const networkLayout& layout, int batch, planStorage& storage, bool keepParameters = false){
+    storage.neurons.assign(batch * layout.nNeurons, 0.f);
+    storage.deltas.assign(batch * layout.nNeurons, 0.f);
+    if(!keepParameters){
+        storage.weights.assign(layout.nWeights, 0.f);
+        storage.biases.assign(layout.nBiases, 0.f);
+        storage.norms.assign(layout.nNormParams, 0.f);
+    }
+    storage.weightGradients.assign(layout.nWeights, 0.f);
+    storage.biasGradients.assign(layout.nBiases, 0.f);
+    storage.normGradients.assign(layout.nNormParams, 0.f);
+    storage.normCache.assign(batch * layout.nNeurons, 0.f);
+    storage.normInvStd.assign(layout.nNormParams / 4, 0.f);
+    storage.scratch.assign(layout.scratchSize, 0.f);
+    storage.losses.assign(batch, 0.f);
+    storage.masks.assign(batch * layout.maskStride, 0);
+    storage.targets.assign(batch, 0);
+    return {storage.neurons.data(), storage.deltas.data(), storage.weights.data(), storage.biases.data(), storage.norms.data(),
+            storage.weightGradients.data(), storage.biasGradients.data(), storage.normGradients.data(), storage.masks.data(),
+            storage.normCache.data(), storage.normInvStd.data(), storage.scratch.data(), storage.targets.data(), storage.losses.data()};
+}
+
+/// Removes the nodes that do nothing: dropout with a rate of 0 and ACT_NONE activations
+/// Has to run before lowering.
+/// returns - the number of nodes removed
+inline int optimizeGraph(layerGraph& graph){
+    int removed = 0;
+    for(int n=(int)graph.nodes.size() - 1; n > 0; n--){
+        const graphNode& node = graph.nodes[n];
+        if((node.type == NODE_DROPOUT && node.rate <= 0.f) || (node.type == NODE_ACTIVATION && node.act == ACT_NONE)){
+            graph.nodes.erase(graph.nodes.begin() + n);
+            removed++;
+        }
+    }
+    return removed;
+}
+
+/// Folds every batchnorm node into the dense or conv layer before it, for inference
+/// Each layer's running statistics & affine transform move into its weights & biases (foldBatchNorm), then the
+/// norm nodes are removed & the graph is lowered again. The weight & bias ranges stay where they were, only the
+/// norms are gone: the plan has to be compiled again, and the storage's norms no longer belong to the layout.
+/// graph, layout - the lowered network, updated
+/// buffers - the network's parameters, the weights & biases of the normalized layers are rewritten
+/// returns - the number of norm nodes folded
+inline int foldNormalization(layerGraph& graph, networkLayout& layout, const networkBuffers& buffers){
+    int folded = 0;
+    for(int n=(int)graph.nodes.size() - 1; n > 0; n--){
+        if(graph.nodes[n].type != NODE_NORM) continue;
+        const forwardingLayer& layer = layout.layers[graph.nodes[n].layer];
+        foldBatchNorm(layer, buffers.weights, buffers.biases, buffers.norms + layer.norm.begin);
+        graph.nodes.erase(graph.nodes.begin() + n);
+        folded++;
+    }
+    // Without its norm a layer's epilogue is still in order, so the graph always lowers again
+    if(folded)
+        lowerGraph(graph, layout);
+    return folded;
+}
+
+/// Fuses a lowered graph's schedule into one op per layer (plus the loss)
+/// graph - the lowered graph
+/// layout - its layout
+/// plan - output
+/// weightPrecision - storage of the weights read by the dense forward passes, anything but fp32 needs
+///                   planSyncWeights after every change of the (fp32 master) weights
+inline void compilePlan(const layerGraph& graph, const networkLayout& layout, executionPlan& plan,
+                        precision weightPrecision = PRECISION_FP32){
+    plan.ops.clear();
+    for(int n: layout.schedule){
+        const graphNode& node = graph.nodes[n];
+        switch(node.type){
+            case NODE_DENSE:
+            case NODE_CONV:
+            case NODE_MAXPOOL:
+            case NODE_AVGPOOL:
+                plan.ops.push_back({node.type == NODE_DENSE ? OP_DENSE : node.type == NODE_CONV ? OP_CONV : OP_POOL,
+                                    node.layer, false, false, ACT_NONE, false, false});
+                break;
+            // Epilogue nodes fold into the op of the layer they follow
+            case NODE_NORM:
+                plan.ops.back().norm = true;
+                break;
+            case NODE_ACTIVATION:
+                plan.ops.back().act = node.act;
+                break;
+            case NODE_DROPOUT:
+                plan.ops.back().dropout = true;
+                break;
+            case NODE_LOSS:
+                plan.ops.push_back({OP_LOSS, node.layer, false, false, ACT_NONE, false, false});
+                break;
+            default:
+                break;
+        }
+    }
+    plan.transposedWeights.assign(layout.nWeights, 0.f);
+    plan.weightPrecision = weightPrecision;
+    plan.bf16Weights.assign(weightPrecision == PRECISION_BF16 ? layout.nWeights : 0, bf16{});
+    plan.fp16Weights.assign(weightPrecision == PRECISION_FP16 ? layout.nWeights : 0, fp16{});
+    plan.sparseWeights.assign(layout.layers.size(), csrMatrix{});
+    plan.pruneMask.clear();
+}
+
+/// Prunes a dense layer's smallest weights to a sparsity & records them in the plan's prune mask, so they stay 0
+/// while training goes on (planApplyPruneMask). planSparsify has to run after the last layer was pruned.
+/// returns - the number of weights zeroed
+inline int planPrune(const networkLayout& layout, executionPlan& plan, float* weights, int layerIdx, float sparsity){
+    if(plan.pruneMask.empty())
+        plan.pruneMask.assign(layout.nWeights, 1.f);
+    const forwardingLayer& layer = layout.layers[layerIdx];
+    return pruneWeights(layer, weights, pruningThreshold(layer, weights, sparsity), plan.pruneMask.data());
+}
+
+/// Zeroes the pruned weights the last update moved, has to run after every optimizer step of a pruned plan
+/// (before planSyncWeights)
+inline void planApplyPruneMask(const networkLayout& layout, const executionPlan& plan, float* weights){
+    if(!plan.pruneMask.empty())
+        applyPruneMask(weights, plan.pruneMask.data(), layout.nWeights);
+}
+
+/// Switches each dense layer to the sparse kernels or back, depending on the density of its weights
+/// Has to run again whenever pruning changed which weights are 0.
+/// returns - the number of layers running sparse
+inline int planSparsify(const networkLayout& layout, executionPlan& plan, const float* weights){
+    int sparseLayers = 0;
+    for(planOp& op: plan.ops){
+        if(op.type != OP_DENSE) continue;
+        const forwardingLayer& layer = layout.layers[op.layer];
+        op.sparse = weightDensity(layer, weights) < SPARSE_DENSITY_THRESHOLD;
+        if(op.sparse){
+            csrFromDense(layer, weights, plan.sparseWeights[op.layer]);
+            sparseLayers++;
+        }
+        else
+            plan.sparseWeights[op.layer] = csrMatrix{};
+    }
+    return sparseLayers;
+}
+
+/// Switches the dense layers reading the network's input to the sparse input kernel or back, depending on how many
+/// of the input features are 0 on a sample of the dataset
+/// data - the dataset the plan will be fed
+/// returns - the measured input density
+inline float planSparsifyInput(const networkLayout& layout, executionPlan& plan, const dataset& data){
+    float density = datasetDensity(data, SPARSE_INPUT_SAMPLES);
+    for(planOp& op: plan.ops)
+        if(op.type == OP_DENSE)
+            op.sparseInput = layout.layers[op.layer].neurons.begin == layout.inputNeurons && density < SPARSE_INPUT_DENSITY_THRESHOLD;
+    return density;
+}
+
+/// Refreshes the plan's copies of the dense weights (16 bit, sparse) from the fp32 master weights,
+/// needed after every change of the weights
+inline void planSyncWeights(const networkLayout& layout, executionPlan& plan, const float* weights){
+    for(const planOp& op: plan.ops){
+        if(op.type != OP_DENSE) continue;
+        const forwardingLayer& layer = layout.layers[op.layer];
+        if(op.sparse)
+            csrRefresh(layer, weights, plan.sparseWeights[op.layer]);
+        int length = layer.weights.end - layer.weights.begin;
+        if(plan.weightPrecision == PRECISION_BF16)
+            toHalf(weights + layer.weights.begin, plan.bf16Weights.data() + layer.weights.begin, length);
+        else if(plan.weightPrecision == PRECISION_FP16)
+            toHalf(weights + layer.weights.begin, plan.fp16Weights.data() + layer.weights.begin, length);
+    }
+}
+
+/// Refreshes the transposed copy of the dense weights, needed once per step after the weights change
+inline void planTransposeWeights(const networkLayout& layout, executionPlan& plan, const float* weights){
+    for(const planOp& op: plan.ops){
+        if(op.type != OP_DENSE || op.sparse) continue;
+        const forwardingLayer& layer = layout.layers[op.layer];
+        const float* w = weights + layer.weights.begin;
+        float* wT = plan.transposedWeights.data() + layer.weights.begin;
+        for(int i=0; i < layer.srcNeurons; i++)
+            for(int j=0; j < layer.dstNeurons; j++)
+                wT[j * layer.srcNeurons + i] = w[i * layer.dstNeurons + j];
+    }
+}
+
+/// Utility function to run a dense op on the kernel matching its input
+template<class W>
+inline void planDenseForward(const planOp& op, const forwardingLayer& layer, const W* weights, const networkBuffers& buffers,
+                             int batch, int stride, activation act, const uint64_t* masks, int maskStride){
+    if(op.sparseInput)
+        denseForwardSparseInput(layer, weights, buffers.biases, buffers.neurons, batch, stride, act, masks, maskStride, layer.keep);
+    else
+        denseForward(layer, weights, buffers.biases, buffers.neurons, batch, stride, act, masks, maskStride, layer.keep);
+}
+
+/// Runs the plan forward over a batch, same contract as graphForward
+/// recording - optional tape the ops are recorded on for planBackward
+inline float planForward(const executionPlan& plan, const networkLayout& layout, const networkBuffers& buffers,
+                         int batch, bool training, uint64_t seed, uint64_t firstSample, tape* recording = nullptr){
+    int stride = layout.nNeurons;
+    float loss = 0.f;
+    for(const planOp& op: plan.ops){
+        const forwardingLayer& layer = layout.layers[op.layer];
+        if(op.type == OP_LOSS){
+            loss = softmaxCrossEntropy(buffers.neurons + layer.neurons.begin, stride, buffers.targets, batch, layer.dstNeurons,
+                                       buffers.deltas + layer.neurons.begin, stride, buffers.losses);
+            continue;
+        }
+
+        const uint64_t* masks = nullptr;
+        if(op.dropout && training){
+            for(int b=0; b < batch; b++)
+                dropoutMask(buffers.masks + b * layout.maskStride + layer.maskBegin, layer.dstNeurons, layer.keep,
+                            seed, op.layer, firstSample + b);
+            masks = buffers.masks + layer.maskBegin;
+        }
+        // With batchnorm the layer's kernel leaves the pre-activations and the normalization runs the epilogue
+        activation act = op.norm ? ACT_NONE : op.act;
+        const uint64_t* layerMasks = op.norm ? nullptr : masks;
+        bool propagate = layer.neurons.begin - layer.srcNeurons > 0;  // The input layer needs no deltas
+
+        if(op.type == OP_DENSE){
+            if(op.sparse)
+                sparseDenseForward(layer, plan.sparseWeights[op.layer], buffers.biases, buffers.neurons, batch, stride, act,
+                                   layerMasks, layout.maskStride, layer.keep);
+            else if(plan.weightPrecision == PRECISION_BF16)
+                planDenseForward(op, layer, plan.bf16Weights.data(), buffers, batch, stride, act, layerMasks, layout.maskStride);
+            else if(plan.weightPrecision == PRECISION_FP16)
+                planDenseForward(op, layer, plan.fp16Weights.data(), buffers, batch, stride, act, layerMasks, layout.maskStride);
+            else
+                planDenseForward(op, layer, buffers.weights, buffers, batch, stride, act, layerMasks, layout.maskStride);
+            if(recording && op.sparse)
+                tapeRecord(*recording, sparseDenseOp{&layer, &plan.sparseWeights[op.layer], buffers.neurons, buffers.deltas,
+                                                     buffers.weightGradients, buffers.biasGradients, batch, stride, act, propagate,
+                                                     layerMasks, layout.maskStride, layer.keep});
+            else if(recording)
+                tapeRecord(*recording, denseOp{&layer, buffers.weights, plan.transposedWeights.data(), buffers.neurons, buffers.deltas,
+                                               buffers.weightGradients, buffers.biasGradients, batch, stride, act, propagate,
+                                               layerMasks, layout.maskStride, layer.keep});
+        }
+        else if(op.type == OP_CONV){
+            convForward(layer, buffers.weights, buffers.biases, buffers.neurons, batch, stride, act, buffers.scratch,
+                        layerMasks, layout.maskStride, layer.keep);
+            if(recording)
+                tapeRecord(*recording, convOp{&layer, buffers.weights, buffers.neurons, buffers.deltas, buffers.weightGradients,
+                                              buffers.biasGradients, batch, stride, act, propagate, buffers.scratch,
+                                              layerMasks, layout.maskStride, layer.keep});
+        }
+        else{
+            poolForward(layer, buffers.neurons, batch, stride);
+            if(masks)
+                for(int b=0; b < batch; b++)
+                    activationForward(buffers.neurons + b * stride + layer.neurons.begin, layer.dstNeurons, ACT_NONE,
+                                      masks + b * layout.maskStride, layer.keep);
+            if(recording)
+                tapeRecord(*recording, poolOp{&layer, buffers.neurons, buffers.deltas, batch, stride, masks, layout.maskStride, layer.keep});
+        }
+
+        if(op.norm){
+            float* invStd = buffers.normInvStd + layer.norm.begin / 4;
+            batchNormForward(layer, buffers.norms + layer.norm.begin, buffers.neurons, batch, stride, op.act, training,
+                             buffers.normCache, invStd, masks, layout.maskStride, layer.keep);
+            if(recording)
+                tapeRecord(*recording, batchNormOp{&layer, buffers.norms + layer.norm.begin, buffers.normGradients + layer.norm.begin,
+                                                   buffers.neurons, buffers.deltas, batch, stride, op.act, buffers.normCache, invStd,
+                                                   masks, layout.maskStride, layer.keep});
+        }
+    }
+    return loss;
+}
+
+/// Runs the backward pass recorded by planForward (with training on), same contract as graphBackward
+/// The weights must not change in between. The tape is reset afterwards.
+/// Gradients always use the fp32 master weights, whatever the forward pass read.
+inline void planBackward(executionPlan& plan, const networkLayout& layout, const networkBuffers& buffers, tape& recording){
+    planTransposeWeights(layout, plan, buffers.weights);
+    tapeBackward(recording);
+    tapeReset(recording);
+}
+
+/// Utility function to get the index of the largest value
+inline int argmax(const float* values, int length){
+    int best = 0;
+    for(int i=1; i < length; i++)
+        best = values[i] > values[best] ? i : best;
+    return best;
+}
+
+/// Runs the plan over a whole dataset one sample at a time
+/// buffers - sized for at least one sample, the neurons are overwritten
+/// returns - the fraction of samples whose largest output is their label
+inline float planAccuracy(const executionPlan& plan, const networkLayout& layout, const networkBuffers& buffers, const dataset& data){
+    const forwardingLayer& out = layout.layers.back();
+    int correct = 0;
+    for(int s=0; s < data.nSamples; s++){
+        std::copy_n(data.features.data() + s * data.nFeatures, data.nFeatures, buffers.neurons);
+        planForward(plan, layout, buffers, 1, false, 0, 0);
+        correct += argmax(buffers.neurons + out.neurons.begin, out.dstNeurons) == data.labels[s];
+    }
+    return data.nSamples ? (float)correct / data.nSamples : 0.f;
+}
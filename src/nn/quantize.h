@@ -0,0 +1,234 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "plan.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+// 256 bit VNNI comes either as AVX-512 VNNI, which needs VL for anything narrower than 512 bits, or as AVX-VNNI
+#if defined(__AVX2__) && defined(__AVX512VNNI__) && defined(__AVX512VL__)
+#define QUANT_VNNI_AVX512
+#elif defined(__AVX2__) && defined(__AVXVNNI__)
+#define QUANT_VNNI_AVX
+#endif
+
+// int8 post-training quantization of a dense network and its integer inference engine
+// Weights are quantized per output neuron, symmetric to int8. Each layer's input is quantized per tensor
+// to uint8 with a zero point, both calibrated by running the fp32 network over a sample of the dataset.
+// A layer is then an int32 accumulated uint8 x int8 dot product per neuron, followed by one fused epilogue:
+// dequantize, bias, activation and requantize to the next layer's uint8 input (the last layer keeps floats).
+// Normalization has to be folded into the weights (foldNormalization in nn/plan.h) before quantizing.
+
+const int QUANT_ALIGN = 32;   // Inputs & weight rows are zero padded to whole vectors
+
+struct quantizedLayer{
+    int srcNeurons, dstNeurons;
+    int srcPadded;                       // srcNeurons rounded up to QUANT_ALIGN
+    int dstPadded;                       // dstNeurons rounded up to 4, the rows the kernel handles at once
+    activation act;
+    float inputScale;                    // input = (q - inputZeroPoint) * inputScale
+    int inputZeroPoint;
+    std::vector<int8_t> weights;         // [dstPadded][srcPadded], transposed so every neuron is one contiguous dot product
+    std::vector<float> weightScales;     // Per neuron
+    std::vector<int32_t> weightSums;     // Per neuron, sum of its quantized weights times the input zero point
+    std::vector<float> biases;
+};
+
+struct quantizedNetwork{
+    std::vector<quantizedLayer> layers;
+    std::vector<uint8_t> inputs[2];      // Ping-pong quantized activations, sized for the widest layer
+};
+
+/// Utility function to round & clamp to uint8
+inline uint8_t quantizeU8(float value, float invScale, int zeroPoint){
+    int q = (int)std::lrint(value * invScale) + zeroPoint;
+    return (uint8_t)(q < 0 ? 0 : q > 255 ? 255 : q);
+}
+
+/// Dot products of one uint8 input with 4 int8 weight rows, int32 accumulated
+/// The input is loaded once per step for all 4 rows, which also share one horizontal reduction.
+/// length - multiple of QUANT_ALIGN
+/// rowStride - distance in bytes between the rows
+/// VNNI multiplies & accumulates 4 pairs per lane in one instruction. Plain AVX2 widens to int16 and uses madd,
+/// maddubs would be one instruction less but its int16 pair sums saturate for 255 * 127 * 2.
+inline void dotU8S8x4(const uint8_t* a, const int8_t* w, int length, int rowStride, int32_t* out){
+#if defined(__AVX2__)
+    __m256i acc[4] = {_mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256()};
+    for(int k=0; k < length; k += 32){
+        __m256i va = _mm256_loadu_si256((const __m256i*)(a + k));
+    #if !defined(QUANT_VNNI_AVX512) && !defined(QUANT_VNNI_AVX)
+        __m256i aLo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(va));
+        __m256i aHi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(va, 1));
+    #endif
+        for(int r=0; r < 4; r++){
+            __m256i vw = _mm256_loadu_si256((const __m256i*)(w + r * rowStride + k));
+        #if defined(QUANT_VNNI_AVX512)
+            acc[r] = _mm256_dpbusd_epi32(acc[r], va, vw);
+        #elif defined(QUANT_VNNI_AVX)
+            acc[r] = _mm256_dpbusd_avx_epi32(acc[r], va, vw);
+        #else
+            acc[r] = _mm256_add_epi32(acc[r], _mm256_madd_epi16(aLo, _mm256_cvtepi8_epi16(_mm256_castsi256_si128(vw))));
+            acc[r] = _mm256_add_epi32(acc[r], _mm256_madd_epi16(aHi, _mm256_cvtepi8_epi16(_mm256_extracti128_si256(vw, 1))));
+        #endif
+        }
+    }
+    // Transpose-reduce the 4 accumulators into one vector of 4 sums
+    __m256i s01 = _mm256_hadd_epi32(acc[0], acc[1]);
+    __m256i s23 = _mm256_hadd_epi32(acc[2], acc[3]);
+    __m256i s = _mm256_hadd_epi32(s01, s23);
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1));
+    _mm_storeu_si128((__m128i*)out, sum);
+#else
+    for(int r=0; r < 4; r++){
+        int32_t sum = 0;
+        for(int k=0; k < length; k++)
+            sum += (int32_t)a[k] * (int32_t)w[r * rowStride + k];
+        out[r] = sum;
+    }
+#endif
+}
+
+/// Calibrates & quantizes a network made of dense layers only
+/// plan, layout, buffers - the fp32 network, buffers sized for at least one sample (its neurons are overwritten)
+/// data - samples the activation ranges are measured on
+/// calibrationSamples - how many samples of data to use (the first ones)
+/// network - output
+/// returns - false if the network has a layer the engine does not support (the reason is printed)
+inline bool quantizeNetwork(const executionPlan& plan, const networkLayout& layout, const networkBuffers& buffers,
+                            const dataset& data, int calibrationSamples, quantizedNetwork& network){
+    network = quantizedNetwork{};
+    int nLayers = (int)layout.layers.size();
+    for(int i=0; i < nLayers; i++){
+        const forwardingLayer& layer = layout.layers[i];
+        if(layer.type != LAYER_DENSE || layer.norm.end > layer.norm.begin){
+            std::cerr << "ERROR::QUANTIZATION_UNSUPPORTED\nLayer " << i << " (" << LAYER_TYPE_NAMES[layer.type]
+                      << "): only dense layers without normalization (foldNormalization first) can be quantized" << std::endl;
+            return false;
+        }
+    }
+
+    // Range of every layer's input over the calibration set, always containing 0 so it is exactly representable
+    std::vector<float> minInput(nLayers, 0.f), maxInput(nLayers, 0.f);
+    calibrationSamples = calibrationSamples < data.nSamples ? calibrationSamples : data.nSamples;
+    for(int s=0; s < calibrationSamples; s++){
+        std::copy_n(data.features.data() + s * data.nFeatures, data.nFeatures, buffers.neurons);
+        planForward(plan, layout, buffers, 1, false, 0, 0);
+        for(int i=0; i < nLayers; i++){
+            const forwardingLayer& layer = layout.layers[i];
+            const float* in = buffers.neurons + layer.neurons.begin - layer.srcNeurons;
+            for(int k=0; k < layer.srcNeurons; k++){
+                minInput[i] = in[k] < minInput[i] ? in[k] : minInput[i];
+                maxInput[i] = in[k] > maxInput[i] ? in[k] : maxInput[i];
+            }
+        }
+    }
+
+    int widest = 0;
+    for(int i=0; i < nLayers; i++){
+        const forwardingLayer& layer = layout.layers[i];
+        quantizedLayer q;
+        q.srcNeurons = layer.srcNeurons;
+        q.dstNeurons = layer.dstNeurons;
+        q.srcPadded = (layer.srcNeurons + QUANT_ALIGN - 1) / QUANT_ALIGN * QUANT_ALIGN;
+        q.act = (activation)layer.activation;
+        float range = maxInput[i] - minInput[i];
+        q.inputScale = range > 0.f ? range / 255.f : 1.f;
+        q.inputZeroPoint = (int)std::lrint(-minInput[i] / q.inputScale);
+
+        const float* w = buffers.weights + layer.weights.begin;
+        q.dstPadded = (layer.dstNeurons + 3) / 4 * 4;
+        q.weights.assign(q.dstPadded * q.srcPadded, 0);
+        q.weightScales.resize(q.dstNeurons);
+        q.weightSums.resize(q.dstNeurons);
+        q.biases.assign(buffers.biases + layer.biases.begin, buffers.biases + layer.biases.end);
+        for(int j=0; j < q.dstNeurons; j++){
+            float maxAbs = 0.f;
+            for(int k=0; k < q.srcNeurons; k++)
+                maxAbs = std::fabs(w[k * q.dstNeurons + j]) > maxAbs ? std::fabs(w[k * q.dstNeurons + j]) : maxAbs;
+            q.weightScales[j] = maxAbs > 0.f ? maxAbs / 127.f : 1.f;
+            int32_t sum = 0;
+            for(int k=0; k < q.srcNeurons; k++){
+                int8_t qw = (int8_t)std::lrint(w[k * q.dstNeurons + j] / q.weightScales[j]);
+                q.weights[j * q.srcPadded + k] = qw;
+                sum += qw;
+            }
+            q.weightSums[j] = sum * q.inputZeroPoint;
+        }
+        widest = q.srcPadded > widest ? q.srcPadded : widest;
+        network.layers.push_back(std::move(q));
+    }
+
+    // Padding stays zero, the zero weights behind it make it contribute nothing
+    network.inputs[0].assign(widest, 0);
+    network.inputs[1].assign(widest, 0);
+    return true;
+}
+
+/// Runs one sample through the quantized network
+/// input - the sample's fp32 input neurons
+/// logits - output, the last layer's fp32 outputs
+inline void quantizedForward(quantizedNetwork& network, const float* input, float* logits){
+    const quantizedLayer& first = network.layers[0];
+    float invScale = 1.f / first.inputScale;
+    for(int k=0; k < first.srcNeurons; k++)
+        network.inputs[0][k] = quantizeU8(input[k], invScale, first.inputZeroPoint);
+
+    int nLayers = (int)network.layers.size();
+    int32_t dots[4];
+    for(int i=0; i < nLayers; i++){
+        const quantizedLayer& layer = network.layers[i];
+        const uint8_t* in = network.inputs[i & 1].data();
+        bool last = i == nLayers - 1;
+        uint8_t* next = network.inputs[(i + 1) & 1].data();
+        float nextInvScale = last ? 0.f : 1.f / network.layers[i + 1].inputScale;
+        int nextZeroPoint = last ? 0 : network.layers[i + 1].inputZeroPoint;
+
+        for(int j=0; j < layer.dstNeurons; j++){
+            if(j % 4 == 0)
+                dotU8S8x4(in, layer.weights.data() + j * layer.srcPadded, layer.srcPadded, layer.srcPadded, dots);
+            int32_t acc = dots[j % 4] - layer.weightSums[j];
+            // Fused dequantize + bias + activation + requantize
+            float y = acc * layer.inputScale * layer.weightScales[j] + layer.biases[j];
+            if(layer.act == ACT_SOFTPLUS)
+                y = y > 20.f ? y : std::log1p(std::exp(y));
+            if(last)
+                logits[j] = y;
+            else
+                next[j] = quantizeU8(y, nextInvScale, nextZeroPoint);
+        }
+    }
+}
+
+/// Prints the accuracy of the fp32 & quantized networks over a dataset, and how often they agree
+/// returns - the accuracy of the quantized network
+inline float reportQuantization(const executionPlan& plan, const networkLayout& layout, const networkBuffers& buffers,
+                               quantizedNetwork& network, const dataset& data){
+    const forwardingLayer& out = layout.layers.back();
+    std::vector<float> logits(out.dstNeurons);
+    int fp32Correct = 0, int8Correct = 0, agree = 0;
+    for(int s=0; s < data.nSamples; s++){
+        const float* sample = data.features.data() + s * data.nFeatures;
+        std::copy_n(sample, data.nFeatures, buffers.neurons);
+        planForward(plan, layout, buffers, 1, false, 0, 0);
+        int fp32Class = argmax(buffers.neurons + out.neurons.begin, out.dstNeurons);
+        quantizedForward(network, sample, logits.data());
+        int int8Class = argmax(logits.data(), out.dstNeurons);
+        fp32Correct += fp32Class == data.labels[s];
+        int8Correct += int8Class == data.labels[s];
+        agree += fp32Class == int8Class;
+    }
+
+    size_t fp32Bytes = 0, int8Bytes = 0;
+    for(const quantizedLayer& layer: network.layers){
+        fp32Bytes += (layer.srcNeurons + 1) * layer.dstNeurons * sizeof(float);
+        int8Bytes += layer.weights.size() + layer.dstNeurons * (2 * sizeof(float) + sizeof(int32_t));
+    }
+    std::cout << "Quantization over " << data.nSamples << " samples\n"
+              << "  fp32 accuracy: " << 100.f * fp32Correct / data.nSamples << "%\n"
+              << "  int8 accuracy: " << 100.f * int8Correct / data.nSamples << "%\n"
+              << "  agreement: " << 100.f * agree / data.nSamples << "%\n"
+              << "  model size: " << fp32Bytes << " -> " << int8Bytes << " bytes" << std::endl;
+    return data.nSamples ? (float)int8Correct / data.nSamples : 0.f;
+}
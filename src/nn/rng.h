@@ -0,0 +1,198 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Counter-based random numbers (Philox4x32-10)
+// Every value is a pure function of (seed, stream, layer, index), so any range of a buffer can be
+// filled independently, by any thread, in any order, and still come out bit-identical.
+
+// Independent sequences, so that e.g. dropout never reuses the numbers drawn for the weights
+enum rngStream : uint32_t { RNG_INIT, RNG_SHUFFLE, RNG_SAMPLE, RNG_DROPOUT, RNG_DEBUG };
+
+const uint32_t PHILOX_M0 = 0xD2511F53u, PHILOX_M1 = 0xCD9E8D57u;
+const uint32_t PHILOX_W0 = 0x9E3779B9u, PHILOX_W1 = 0xBB67AE85u;
+const int PHILOX_LANES = 8;  // Blocks generated side by side by the bulk fills, wide enough for the compiler to vectorize
+const int64_t RNG_CHUNK = 1024;  // Words a float fill generates before converting them, on the stack of each thread
+const int64_t RNG_PARALLEL_MIN = 1 << 16;  // Values a bulk fill needs before it is split across threads (OpenMP)
+
+/// Utility function to run the 10 Philox rounds on one block
+/// ctr - the 4 word counter, replaced with 4 random words
+/// seed - the key
+inline void philox4x32(uint32_t ctr[4], uint64_t seed){
+    uint32_t k0 = (uint32_t)seed, k1 = (uint32_t)(seed >> 32);
+    for(int r=0; r < 10; r++){
+        uint64_t p0 = (uint64_t)PHILOX_M0 * ctr[0];
+        uint64_t p1 = (uint64_t)PHILOX_M1 * ctr[2];
+        uint32_t c0 = (uint32_t)(p1 >> 32) ^ ctr[1] ^ k0;
+        uint32_t c2 = (uint32_t)(p0 >> 32) ^ ctr[3] ^ k1;
+        ctr[0] = c0; ctr[1] = (uint32_t)p1;
+        ctr[2] = c2; ctr[3] = (uint32_t)p0;
+        k0 += PHILOX_W0; k1 += PHILOX_W1;
+    }
+}
+
+/// Utility function to get a single random word
+/// Word index of (seed, stream, layer) is word (index % 4) of the block counted by index / 4
+/// returns - a uniformly distributed 32 bit value
+inline uint32_t rngUint(uint64_t seed, uint32_t stream, uint32_t layer, uint64_t index){
+    uint32_t ctr[4] = {(uint32_t)(index >> 2), (uint32_t)(index >> 34), layer, stream};
+    philox4x32(ctr, seed);
+    return ctr[index & 3];
+}
+
+/// Utility function to map a random word to a float in [0, 1)
+inline float rngToUnit(uint32_t bits){
+    return (float)(bits >> 8) * (1.f / 16777216.f);
+}
+
+/// Utility function to get a single random float in [0, 1)
+inline float rngUniform(uint64_t seed, uint32_t stream, uint32_t layer, uint64_t index){
+    return rngToUnit(rngUint(seed, stream, layer, index));
+}
+
+/// Utility function to split a bulk fill into one contiguous slice per thread
+/// With OpenMP, fills of at least RNG_PARALLEL_MIN values get one thread team, each thread filling a slice of its own
+/// (starting on a whole chunk of blocks) with fill(begin, end). Smaller fills stay on the calling thread, they are
+/// cheaper than waking the team. Values only depend on their index, so any split gives the same result.
+/// length - the number of values
+template<class F>
+inline void rngParallelSlices(int64_t length, F fill){
+#ifdef _OPENMP
+    if(length >= RNG_PARALLEL_MIN){
+        #pragma omp parallel
+        {
+            const int64_t align = 4 * PHILOX_LANES;
+            int64_t threads = omp_get_num_threads(), t = omp_get_thread_num();
+            int64_t begin = length * t / threads / align * align;
+            int64_t end = t == threads - 1 ? length : length * (t + 1) / threads / align * align;
+            if(begin < end)
+                fill(begin, end);
+        }
+        return;
+    }
+#endif
+    fill(0, length);
+}
+
+/// Fills a buffer with consecutive random words of (seed, stream, layer) on the calling thread
+/// Blocks are generated PHILOX_LANES at a time in structure-of-arrays form so the rounds vectorize.
+/// out - the buffer to be filled
+/// length - the number of words
+/// offset - index of the first word, so a buffer can be filled in independent slices
+inline void rngFillUintSlice(uint32_t* out, int64_t length, uint64_t seed, uint32_t stream, uint32_t layer, uint64_t offset){
+    int64_t i = 0;
+    // Head, up to the first whole block
+    for(; i < length && ((offset + i) & 3) != 0; i++)
+        out[i] = rngUint(seed, stream, layer, offset + i);
+
+    uint64_t firstBlock = (offset + i) >> 2;
+    int64_t nChunks = (length - i) / (4 * PHILOX_LANES);
+    uint32_t* body = out + i;
+    for(int64_t chunk=0; chunk < nChunks; chunk++){
+        uint32_t c0[PHILOX_LANES], c1[PHILOX_LANES], c2[PHILOX_LANES], c3[PHILOX_LANES];
+        for(int l=0; l < PHILOX_LANES; l++){
+            uint64_t block = firstBlock + chunk * PHILOX_LANES + l;
+            c0[l] = (uint32_t)block; c1[l] = (uint32_t)(block >> 32);
+            c2[l] = layer; c3[l] = stream;
+        }
+        uint32_t k0 = (uint32_t)seed, k1 = (uint32_t)(seed >> 32);
+        for(int r=0; r < 10; r++){
+            for(int l=0; l < PHILOX_LANES; l++){
+                uint64_t p0 = (uint64_t)PHILOX_M0 * c0[l];
+                uint64_t p1 = (uint64_t)PHILOX_M1 * c2[l];
+                c0[l] = (uint32_t)(p1 >> 32) ^ c1[l] ^ k0;
+                c2[l] = (uint32_t)(p0 >> 32) ^ c3[l] ^ k1;
+                c1[l] = (uint32_t)p1;
+                c3[l] = (uint32_t)p0;
+            }
+            k0 += PHILOX_W0; k1 += PHILOX_W1;
+        }
+        uint32_t* dst = body + chunk * 4 * PHILOX_LANES;
+        for(int l=0; l < PHILOX_LANES; l++){
+            dst[4*l] = c0[l]; dst[4*l + 1] = c1[l]; dst[4*l + 2] = c2[l]; dst[4*l + 3] = c3[l];
+        }
+    }
+
+    // Tail
+    for(i += nChunks * 4 * PHILOX_LANES; i < length; i++)
+        out[i] = rngUint(seed, stream, layer, offset + i);
+}
+
+/// Fills a buffer with consecutive random words of (seed, stream, layer), starting at word offset
+/// Large fills are split across threads (rngParallelSlices) without changing the result.
+/// out - the buffer to be filled
+/// length - the number of words
+/// offset - index of the first word, so a buffer can be filled in independent slices
+inline void rngFillUint(uint32_t* out, int64_t length, uint64_t seed, uint32_t stream, uint32_t layer, uint64_t offset = 0){
+    rngParallelSlices(length, [&](int64_t begin, int64_t end){
+        rngFillUintSlice(out + begin, end - begin, seed, stream, layer, offset + begin);
+    });
+}
+
+/// Fills a buffer with uniformly distributed floats in [low, high)
+/// Every thread takes a slice of the buffer, generating its random words a chunk at a time then converting them
+inline void rngFillUniform(float* out, int64_t length, float low, float high, uint64_t seed, uint32_t stream, uint32_t layer, uint64_t offset = 0){
+    float scale = high - low;
+    rngParallelSlices(length, [&](int64_t sliceBegin, int64_t sliceEnd){
+        uint32_t bits[RNG_CHUNK];
+        for(int64_t begin=sliceBegin; begin < sliceEnd; begin += RNG_CHUNK){
+            int64_t n = sliceEnd - begin < RNG_CHUNK ? sliceEnd - begin : RNG_CHUNK;
+            rngFillUintSlice(bits, n, seed, stream, layer, offset + begin);
+            for(int64_t i=0; i < n; i++)
+                out[begin + i] = low + rngToUnit(bits[i]) * scale;
+        }
+    });
+}
+
+/// Fills a buffer with normally distributed floats (Box-Muller on pairs of words)
+/// Element i uses words 2i & 2i + 1, so slices stay independent
+inline void rngFillNormal(float* out, int64_t length, float mean, float stddev, uint64_t seed, uint32_t stream, uint32_t layer, uint64_t offset = 0){
+    rngParallelSlices(length, [&](int64_t sliceBegin, int64_t sliceEnd){
+        uint32_t bits[RNG_CHUNK];
+        for(int64_t begin=sliceBegin; begin < sliceEnd; begin += RNG_CHUNK / 2){
+            int64_t n = sliceEnd - begin < RNG_CHUNK / 2 ? sliceEnd - begin : RNG_CHUNK / 2;
+            rngFillUintSlice(bits, 2 * n, seed, stream, layer, 2 * (offset + begin));
+            for(int64_t i=0; i < n; i++){
+                float u1 = 1.f - rngToUnit(bits[2*i]);   // (0, 1] so the log is finite
+                float u2 = rngToUnit(bits[2*i + 1]);
+                out[begin + i] = mean + stddev * std::sqrt(-2.f * std::log(u1)) * std::cos(6.28318530718f * u2);
+            }
+        }
+    });
+}
+
+/// Xavier/Glorot uniform initializer, for layers feeding linear or saturating outputs
+/// weights - the layer's weights (fanIn * fanOut long)
+/// fanIn - neurons in the source layer
+/// fanOut - neurons in the destination layer
+/// layer - index of the layer, keys the random sequence
+inline void xavierInit(float* weights, int fanIn, int fanOut, uint64_t seed, uint32_t layer){
+    float limit = std::sqrt(6.f / (float)(fanIn + fanOut));
+    rngFillUniform(weights, (int64_t)fanIn * fanOut, -limit, limit, seed, RNG_INIT, layer);
+}
+
+/// He/Kaiming normal initializer, for layers followed by ReLU-like activations (softplus included)
+/// weights - the layer's weights (fanIn * fanOut long)
+/// fanIn - neurons in the source layer
+/// fanOut - neurons in the destination layer
+/// layer - index of the layer, keys the random sequence
+inline void heInit(float* weights, int fanIn, int fanOut, uint64_t seed, uint32_t layer){
+    rngFillNormal(weights, (int64_t)fanIn * fanOut, 0.f, std::sqrt(2.f / (float)fanIn), seed, RNG_INIT, layer);
+}
+
+/// Shuffles indices for an epoch (Fisher-Yates), the order only depends on (seed, epoch)
+/// The device dataset's permutations are shuffled with it & uploaded (main.cpp).
+/// indices - the array to be shuffled in place
+/// length - the length of the array
+/// epoch - the epoch number, keys the random sequence
+inline void rngShuffle(int* indices, int length, uint64_t seed, uint32_t epoch){
+    for(int i=length - 1; i > 0; i--){
+        int j = (int)(((uint64_t)rngUint(seed, RNG_SHUFFLE, epoch, (uint64_t)i) * (uint64_t)(i + 1)) >> 32);
+        int tmp = indices[i];
+        indices[i] = indices[j];
+        indices[j] = tmp;
+    }
+}
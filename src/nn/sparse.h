@@ -0,0 +1,156 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "layers.h"
+#include "dense.h"
+
+// Magnitude pruning of dense layers & the CSR kernels that skip the pruned weights
+// Pruning zeroes the smallest weights of a layer, once after training or gradually while training.
+// A layer whose density falls low enough runs on a CSR copy of its weights: one row per source neuron
+// listing its remaining destination neurons. The fp32 dense weights stay the master copy the optimizer
+// updates, the sparse kernels only accumulate gradients for the weights that were kept, so pruned ones stay 0.
+// The dense kernels don't skip them, so a pruned layer still too dense for the CSR kernels would grow its weights
+// back: pruning also clears a prune mask (1 per kept weight, 0 per pruned one) that is applied after every update.
+
+const float SPARSE_DENSITY_THRESHOLD = 0.2f;   // Measured crossover, layers denser than this run faster on the dense kernels
+const float SPARSE_INPUT_DENSITY_THRESHOLD = 0.4f;  // Measured crossover of the sparse input kernel (denseForwardSparseInput)
+const int SPARSE_INPUT_SAMPLES = 1024;              // Samples planSparsifyInput measures the input density on
+
+struct csrMatrix{
+    int rows, cols;
+    std::vector<int> rowBegin;   // rows + 1 entries, row i is [rowBegin[i], rowBegin[i + 1])
+    std::vector<int> columns;
+    std::vector<float> values;
+};
+
+/// Utility function to get the fraction of a layer's weights that are not 0
+inline float weightDensity(const forwardingLayer& layer, const float* weights){
+    int length = layer.weights.end - layer.weights.begin, nonzero = 0;
+    for(int i=0; i < length; i++)
+        nonzero += weights[layer.weights.begin + i] != 0.f;
+    return length ? (float)nonzero / length : 1.f;
+}
+
+/// Utility function to get the magnitude below which a fraction of a layer's weights lies
+inline float pruningThreshold(const forwardingLayer& layer, const float* weights, float sparsity){
+    int length = layer.weights.end - layer.weights.begin;
+    int cut = (int)(sparsity * length);
+    if(cut <= 0) return 0.f;
+    std::vector<float> magnitudes(length);
+    for(int i=0; i < length; i++)
+        magnitudes[i] = std::fabs(weights[layer.weights.begin + i]);
+    std::nth_element(magnitudes.begin(), magnitudes.begin() + cut - 1, magnitudes.end());
+    return magnitudes[cut - 1];
+}
+
+/// Zeroes a layer's weights whose magnitude is at most the threshold
+/// mask - the network's prune mask [nWeights], the zeroed weights are cleared in it, can be null
+/// returns - the number of weights zeroed
+inline int pruneWeights(const forwardingLayer& layer, float* weights, float threshold, float* mask = nullptr){
+    int pruned = 0;
+    for(int i=layer.weights.begin; i < layer.weights.end; i++)
+        if(std::fabs(weights[i]) <= threshold){
+            pruned += weights[i] != 0.f;
+            weights[i] = 0.f;
+            if(mask) mask[i] = 0.f;
+        }
+    return pruned;
+}
+
+/// Zeroes the pruned weights again after an update, same for every layer (the mask of unpruned layers is all 1)
+/// mask - the prune mask [nWeights]
+inline void applyPruneMask(float* weights, const float* mask, int nWeights){
+    for(int i=0; i < nWeights; i++)
+        weights[i] *= mask[i];
+}
+
+/// Sparsity to prune to at a step of gradual pruning, ramps from 0 to the final sparsity
+/// quickly at first and slowly near the end so the network can recover from the bigger cuts
+/// beginStep, endStep - the steps the ramp spans
+inline float gradualSparsity(uint64_t step, uint64_t beginStep, uint64_t endStep, float finalSparsity){
+    if(step <= beginStep) return 0.f;
+    if(step >= endStep) return finalSparsity;
+    float remaining = 1.f - (float)(step - beginStep) / (endStep - beginStep);
+    return finalSparsity * (1.f - remaining * remaining * remaining);
+}
+
+/// Builds the CSR copy of a dense layer's nonzero weights ([src][dst] order, so rows are source neurons)
+inline void csrFromDense(const forwardingLayer& layer, const float* weights, csrMatrix& csr){
+    const float* w = weights + layer.weights.begin;
+    csr.rows = layer.srcNeurons;
+    csr.cols = layer.dstNeurons;
+    csr.rowBegin.assign(1, 0);
+    csr.columns.clear();
+    csr.values.clear();
+    for(int i=0; i < csr.rows; i++){
+        for(int j=0; j < csr.cols; j++)
+            if(w[i * csr.cols + j] != 0.f){
+                csr.columns.push_back(j);
+                csr.values.push_back(w[i * csr.cols + j]);
+            }
+        csr.rowBegin.push_back((int)csr.columns.size());
+    }
+}
+
+/// Copies the current values of the kept weights into the CSR copy, the structure stays the same
+inline void csrRefresh(const forwardingLayer& layer, const float* weights, csrMatrix& csr){
+    const float* w = weights + layer.weights.begin;
+    for(int i=0; i < csr.rows; i++)
+        for(int k=csr.rowBegin[i]; k < csr.rowBegin[i + 1]; k++)
+            csr.values[k] = w[i * csr.cols + csr.columns[k]];
+}
+
+/// Forward pass of a pruned dense layer, same contract as denseForward
+/// Each kept weight is loaded once and applied to the whole batch, the samples' updates are independent
+/// so they overlap instead of waiting on each other's scattered stores.
+inline void sparseDenseForward(const forwardingLayer& layer, const csrMatrix& csr, const float* biases, float* neurons,
+                               int batch, int stride, activation act,
+                               const uint64_t* masks = nullptr, int maskStride = 0, float keep = 1.f){
+    const float* bias = biases + layer.biases.begin;
+    const float* in = neurons + layer.neurons.begin - layer.srcNeurons;
+    float* out = neurons + layer.neurons.begin;
+    for(int b=0; b < batch; b++)
+        for(int j=0; j < csr.cols; j++)
+            out[b * stride + j] = bias[j];
+    for(int i=0; i < csr.rows; i++)
+        for(int k=csr.rowBegin[i]; k < csr.rowBegin[i + 1]; k++){
+            float w = csr.values[k];
+            float* o = out + csr.columns[k];
+            for(int b=0; b < batch; b++)
+                o[b * stride] += in[b * stride + i] * w;
+        }
+    for(int b=0; b < batch; b++)
+        activationForward(out + b * stride, csr.cols, act, masks ? masks + b * maskStride : nullptr, keep);
+}
+
+/// Backward pass of a pruned dense layer, same contract as denseBackward
+/// Only the kept weights' gradients are accumulated (weightGradients is still the dense layout).
+inline void sparseDenseBackward(const forwardingLayer& layer, const csrMatrix& csr, const float* neurons, float* deltas,
+                                float* weightGradients, float* biasGradients, int batch, int stride, activation act, bool propagate,
+                                const uint64_t* masks = nullptr, int maskStride = 0, float keep = 1.f){
+    float* wGrad = weightGradients + layer.weights.begin;
+    float* bGrad = biasGradients + layer.biases.begin;
+    const float* in = neurons + layer.neurons.begin - layer.srcNeurons;
+    const float* out = neurons + layer.neurons.begin;
+    float* d = deltas + layer.neurons.begin;
+    float* srcD = d - layer.srcNeurons;
+
+    for(int b=0; b < batch; b++){
+        activationBackward(d + b * stride, out + b * stride, csr.cols, act, masks ? masks + b * maskStride : nullptr, keep);
+        for(int j=0; j < csr.cols; j++)
+            bGrad[j] += d[b * stride + j];
+    }
+
+    for(int b=0; b < batch; b++)
+        for(int i=0; i < csr.rows; i++){
+            float x = in[b * stride + i], sum = 0.f;
+            for(int k=csr.rowBegin[i]; k < csr.rowBegin[i + 1]; k++){
+                float g = d[b * stride + csr.columns[k]];
+                wGrad[i * csr.cols + csr.columns[k]] += x * g;
+                sum += csr.values[k] * g;
+            }
+            if(propagate)
+                srcD[b * stride + i] = sum;
+        }
+}
@@ -0,0 +1,186 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+#include "plan.h"
+
+// Structured pruning of hidden dense layers
+// Zeroing weights only pays off through the sparse kernels, removing whole neurons shrinks the layer itself:
+// the layer loses columns of its weights, the next dense layer loses rows, and every buffer is laid out again
+// compactly so the smaller network runs on the ordinary dense kernels.
+// A neuron is scored by how much the next layer's pre-activations vary because of it: the standard deviation
+// of its output over a calibration set times the norm of its outgoing weights. What it contributes on average
+// is kept, folded into the next layer's biases.
+
+/// Utility function to tell whether a layer's neurons can be removed
+/// It has to be a dense layer whose outputs only feed another dense layer (not the logits, not a conv).
+inline bool prunableLayer(const networkLayout& layout, int layerIdx){
+    int next = layerIdx + 1;
+    return layout.layers[layerIdx].type == LAYER_DENSE && layerIdx != layout.lossLayer &&
+           next < (int)layout.layers.size() && layout.layers[next].type == LAYER_DENSE;
+}
+
+/// Mean & standard deviation of a layer's outputs over the first samples of a dataset (inference mode)
+/// buffers - sized for at least one sample, the neurons are overwritten
+/// means, deviations - output, one per neuron of the layer
+inline void neuronStatistics(const executionPlan& plan, const networkLayout& layout, const networkBuffers& buffers,
+                             const dataset& data, int layerIdx, int calibrationSamples,
+                             std::vector<double>& means, std::vector<double>& deviations){
+    const forwardingLayer& layer = layout.layers[layerIdx];
+    means.assign(layer.dstNeurons, 0.0);
+    deviations.assign(layer.dstNeurons, 0.0);
+    calibrationSamples = calibrationSamples < data.nSamples ? calibrationSamples : data.nSamples;
+    for(int s=0; s < calibrationSamples; s++){
+        std::copy_n(data.features.data() + s * data.nFeatures, data.nFeatures, buffers.neurons);
+        planForward(plan, layout, buffers, 1, false, 0, 0);
+        const float* out = buffers.neurons + layer.neurons.begin;
+        for(int j=0; j < layer.dstNeurons; j++){
+            means[j] += out[j];
+            deviations[j] += (double)out[j] * out[j];
+        }
+    }
+    for(int j=0; j < layer.dstNeurons; j++){
+        means[j] /= calibrationSamples > 0 ? calibrationSamples : 1;
+        double variance = deviations[j] / (calibrationSamples > 0 ? calibrationSamples : 1) - means[j] * means[j];
+        deviations[j] = std::sqrt(variance > 0.0 ? variance : 0.0);
+    }
+}
+
+/// Removes neurons from a hidden dense node of a lowered graph
+/// The graph is lowered again and the weights, biases & batchnorm parameters are repacked into the new layout.
+/// The other buffers (neurons, gradients...) & any compiled plan have to be rebuilt from the new layout.
+/// graph, layout - the network, updated
+/// weights, biases, norms - the network's parameters, updated
+/// nodeIdx - the dense node, its layer has to be prunableLayer
+/// kept - the neurons to keep, increasing
+/// means - mean output of every neuron of the layer, the removed ones' are folded into the next layer's biases
+/// returns - false if the graph cannot be lowered anymore (nothing changed)
+inline bool pruneNeurons(layerGraph& graph, networkLayout& layout, std::vector<float>& weights, std::vector<float>& biases,
+                         std::vector<float>& norms, int nodeIdx, const std::vector<int>& kept, const std::vector<double>& means){
+    int layerIdx = graph.nodes[nodeIdx].layer;
+    networkLayout oldLayout = layout;
+    const forwardingLayer& old = oldLayout.layers[layerIdx];
+    const forwardingLayer& oldNext = oldLayout.layers[layerIdx + 1];
+    int n = old.dstNeurons, k = (int)kept.size(), dst = oldNext.dstNeurons;
+
+    // The epilogue nodes after the layer carry its shape too
+    int epilogueEnd = nodeIdx + 1;
+    while(epilogueEnd < (int)graph.nodes.size() && (graph.nodes[epilogueEnd].type == NODE_NORM ||
+          graph.nodes[epilogueEnd].type == NODE_ACTIVATION || graph.nodes[epilogueEnd].type == NODE_DROPOUT))
+        epilogueEnd++;
+    shape previous = graph.nodes[nodeIdx].out;
+    for(int e=nodeIdx; e < epilogueEnd; e++)
+        graph.nodes[e].out = {k, 1, 1};
+    if(!lowerGraph(graph, layout)){
+        for(int e=nodeIdx; e < epilogueEnd; e++)
+            graph.nodes[e].out = previous;
+        lowerGraph(graph, layout);
+        return false;
+    }
+
+    std::vector<float> newWeights(layout.nWeights), newBiases(layout.nBiases), newNorms(layout.nNormParams);
+    for(int l=0; l < (int)layout.layers.size(); l++){
+        const forwardingLayer& layer = layout.layers[l];
+        const forwardingLayer& source = oldLayout.layers[l];
+        float* w = newWeights.data() + layer.weights.begin;
+        float* b = newBiases.data() + layer.biases.begin;
+        float* p = newNorms.data() + layer.norm.begin;
+        const float* oldW = weights.data() + source.weights.begin;
+        const float* oldB = biases.data() + source.biases.begin;
+        const float* oldP = norms.data() + source.norm.begin;
+
+        if(l == layerIdx){
+            // [src][dst] keeps the columns, biases & every batchnorm parameter (one per channel) of the kept neurons
+            for(int i=0; i < layer.srcNeurons; i++)
+                for(int c=0; c < k; c++)
+                    w[i * k + c] = oldW[i * n + kept[c]];
+            for(int c=0; c < k; c++)
+                b[c] = oldB[kept[c]];
+            if(layer.norm.end > layer.norm.begin)
+                for(int q=0; q < 4; q++)
+                    for(int c=0; c < k; c++)
+                        p[q * k + c] = oldP[q * n + kept[c]];
+        }
+        else if(l == layerIdx + 1){
+            // Keeps the rows of the kept source neurons, the removed ones leave their mean contribution in the biases
+            std::copy(oldB, oldB + dst, b);
+            for(int i=0, c=0; i < n; i++){
+                if(c < k && kept[c] == i)
+                    std::copy_n(oldW + i * dst, dst, w + c++ * dst);
+                else
+                    for(int j=0; j < dst; j++)
+                        b[j] += (float)(means[i] * oldW[i * dst + j]);
+            }
+            std::copy(norms.begin() + source.norm.begin, norms.begin() + source.norm.end, p);
+        }
+        else{
+            std::copy(weights.begin() + source.weights.begin, weights.begin() + source.weights.end, w);
+            std::copy(biases.begin() + source.biases.begin, biases.begin() + source.biases.end, b);
+            std::copy(norms.begin() + source.norm.begin, norms.begin() + source.norm.end, p);
+        }
+    }
+    weights.swap(newWeights);
+    biases.swap(newBiases);
+    norms.swap(newNorms);
+    return true;
+}
+
+/// Removes a fraction of the neurons of every prunable layer, and prints the accuracy before & after
+/// Layers are pruned first to last, each scored on the network the previous ones left.
+/// The network is rebuilt in place: graph, layout, plan & storage (sized for one sample) all change.
+/// fraction - of each layer's neurons to remove, at least one neuron is always kept
+/// data - samples to score the neurons & measure the accuracy on
+/// calibrationSamples - how many samples of data to score the neurons on (the first ones)
+/// returns - the number of neurons removed
+inline int structuredPrune(layerGraph& graph, networkLayout& layout, executionPlan& plan, planStorage& storage,
+                           const dataset& data, float fraction, int calibrationSamples){
+    networkBuffers buffers = allocatePlanBuffers(layout, 1, storage, true);
+    float before = planAccuracy(plan, layout, buffers, data);
+
+    int removed = 0;
+    for(int nodeIdx=1; nodeIdx < (int)graph.nodes.size(); nodeIdx++){
+        if(graph.nodes[nodeIdx].type != NODE_DENSE) continue;
+        int layerIdx = graph.nodes[nodeIdx].layer;
+        if(!prunableLayer(layout, layerIdx)) continue;
+        const forwardingLayer& layer = layout.layers[layerIdx];
+        const forwardingLayer& next = layout.layers[layerIdx + 1];
+        int n = layer.dstNeurons;
+        int k = n - (int)(fraction * n);
+        k = k > 0 ? k : 1;
+        if(k == n) continue;
+
+        std::vector<double> means, deviations, scores(n);
+        neuronStatistics(plan, layout, buffers, data, layerIdx, calibrationSamples, means, deviations);
+        const float* outgoing = storage.weights.data() + next.weights.begin;
+        for(int i=0; i < n; i++){
+            double norm = 0.0;
+            for(int j=0; j < next.dstNeurons; j++)
+                norm += (double)outgoing[i * next.dstNeurons + j] * outgoing[i * next.dstNeurons + j];
+            scores[i] = deviations[i] * std::sqrt(norm);
+        }
+        std::vector<int> kept(n);
+        for(int i=0; i < n; i++)
+            kept[i] = i;
+        std::nth_element(kept.begin(), kept.begin() + k, kept.end(), [&](int a, int b){ return scores[a] > scores[b]; });
+        kept.resize(k);
+        std::sort(kept.begin(), kept.end());
+
+        int macsBefore = layer.srcNeurons * n + n * next.dstNeurons;
+        int macsAfter = layer.srcNeurons * k + k * next.dstNeurons;
+        if(!pruneNeurons(graph, layout, storage.weights, storage.biases, storage.norms, nodeIdx, kept, means))
+            continue;
+        std::cout << "Pruned layer " << layerIdx << ": " << n << " -> " << k << " neurons, " << macsBefore << " -> "
+                  << macsAfter << " multiply-adds per sample" << std::endl;
+        removed += n - k;
+
+        compilePlan(graph, layout, plan, plan.weightPrecision);
+        buffers = allocatePlanBuffers(layout, 1, storage, true);
+        planSyncWeights(layout, plan, buffers.weights);
+    }
+
+    float after = planAccuracy(plan, layout, buffers, data);
+    std::cout << "Structured pruning removed " << removed << " neurons, accuracy " << 100.f * before << "% -> "
+              << 100.f * after << "% (" << 100.f * (after - before) << ")" << std::endl;
+    return removed;
+}
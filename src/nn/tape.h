@@ -0,0 +1,161 @@
+#pragma once
+#include "arena.h"
+#include "layers.h"
+#include "dense.h"
+#include "conv.h"
+#include "batchnorm.h"
+#include "sparse.h"
+
+// Reverse-mode autodiff tape
+// A forward pass records one entry per differentiable op, holding a copy of what the op's backward needs.
+// The backward pass replays the entries newest first, each calling the batched backward kernel of its op,
+// so a new layer or loss only has to provide an op struct with a backward() method and record it.
+// Entries & their op structs live in a bump arena, reset after every step instead of freed.
+//
+// Deltas follow the kernels' convention: on entry to an op's backward its outputs' deltas hold
+// dLoss/dOutput, on exit its inputs' deltas are overwritten (chains only, nothing accumulates into them).
+// The loss seeds the deltas of the logits during the forward pass, so it records nothing.
+
+struct tapeEntry{
+    void (*backward)(const void* op);
+    const void* op;
+    const tapeEntry* previous;
+};
+
+struct tape{
+    arena memory;                       // Freed with the tape, or earlier with tapeFree
+    const tapeEntry* last = nullptr;    // Newest entry, nullptr when empty
+    int size = 0;
+};
+
+/// Records an op on the tape
+/// op - copied into the tape's arena, has to be trivially copyable & provide void backward() const
+template<class Op>
+inline void tapeRecord(tape& t, const Op& op){
+    static_assert(std::is_trivially_copyable<Op>::value, "ops are copied into the arena as plain memory");
+    const Op* stored = arenaCopy(t.memory, op);
+    t.last = arenaCopy(t.memory, tapeEntry{[](const void* p){ static_cast<const Op*>(p)->backward(); }, stored, t.last});
+    t.size++;
+}
+
+/// Replays the tape newest first, running every op's backward
+inline void tapeBackward(const tape& t){
+    for(const tapeEntry* entry=t.last; entry; entry=entry->previous)
+        entry->backward(entry->op);
+}
+
+/// Empties the tape, its arena keeps the memory for the next step
+inline void tapeReset(tape& t){
+    arenaReset(t.memory);
+    t.last = nullptr;
+    t.size = 0;
+}
+
+/// Empties the tape & returns its arena's memory to the heap
+inline void tapeFree(tape& t){
+    arenaFree(t.memory);
+    t.last = nullptr;
+    t.size = 0;
+}
+
+// Ops of the CPU kernels, the pointers are the whole buffers (the layers index into them)
+
+struct denseOp{
+    const forwardingLayer* layer;
+    const float* weights;
+    const float* transposedWeights;   // Optional [dst][src] copy, see denseBackward
+    const float* neurons;
+    float* deltas;
+    float* weightGradients;
+    float* biasGradients;
+    int batch, stride;
+    activation act;
+    bool propagate;
+    const uint64_t* masks;
+    int maskStride;
+    float keep;
+
+    void backward() const{
+        denseBackward(*layer, weights, neurons, deltas, weightGradients, biasGradients, batch, stride, act, propagate,
+                      masks, maskStride, keep, transposedWeights);
+    }
+};
+
+struct sparseDenseOp{
+    const forwardingLayer* layer;
+    const csrMatrix* weights;
+    const float* neurons;
+    float* deltas;
+    float* weightGradients;
+    float* biasGradients;
+    int batch, stride;
+    activation act;
+    bool propagate;
+    const uint64_t* masks;
+    int maskStride;
+    float keep;
+
+    void backward() const{
+        sparseDenseBackward(*layer, *weights, neurons, deltas, weightGradients, biasGradients, batch, stride, act, propagate,
+                            masks, maskStride, keep);
+    }
+};
+
+struct convOp{
+    const forwardingLayer* layer;
+    const float* weights;
+    const float* neurons;
+    float* deltas;
+    float* weightGradients;
+    float* biasGradients;
+    int batch, stride;
+    activation act;
+    bool propagate;
+    float* scratch;
+    const uint64_t* masks;
+    int maskStride;
+    float keep;
+
+    void backward() const{
+        convBackward(*layer, weights, neurons, deltas, weightGradients, biasGradients, batch, stride, act, propagate,
+                     scratch, masks, maskStride, keep);
+    }
+};
+
+// Pool followed by optional dropout (pools have no activation)
+struct poolOp{
+    const forwardingLayer* layer;
+    const float* neurons;
+    float* deltas;
+    int batch, stride;
+    const uint64_t* masks;
+    int maskStride;
+    float keep;
+
+    void backward() const{
+        if(masks)
+            for(int b=0; b < batch; b++)
+                activationBackward(deltas + b * stride + layer->neurons.begin, neurons + b * stride + layer->neurons.begin,
+                                   layer->dstNeurons, ACT_NONE, masks + b * maskStride, keep);
+        poolBackward(*layer, neurons, deltas, batch, stride);
+    }
+};
+
+struct batchNormOp{
+    const forwardingLayer* layer;
+    const float* params;
+    float* paramGradients;
+    const float* neurons;
+    float* deltas;
+    int batch, stride;
+    activation act;
+    const float* xhat;
+    const float* invStd;
+    const uint64_t* masks;
+    int maskStride;
+    float keep;
+
+    void backward() const{
+        batchNormBackward(*layer, params, paramGradients, neurons, deltas, batch, stride, act, xhat, invStd, masks, maskStride, keep);
+    }
+};
@@ -1,21 +1,9 @@
 #version 460 core
 
-struct Range {
-    int begin;
-    int end;
-};
-
-struct ForwardingLayer {
-    Range neurons;
-    Range weights;
-    Range biases;
-    int srcNeurons;   // Previous layer size (input for layer 0)
-    int dstNeurons;   // Current layer size
-};
-
 layout(std430, binding = 0) buffer NeuronsBuffer { float neurons[]; };
 layout(std430, binding = 1) buffer WeightsBuffer { float weights[]; };
-layout(std430, binding = 3) buffer ForwardingLayersBuffer { ForwardingLayer layers[]; };
+// ForwardingLayer and the LAYER_/ACT_ constants are prepended by the loader (nn/layers.h)
+layout(std430, binding = 5) buffer ForwardingLayersBuffer { ForwardingLayer layers[]; };
 
 uniform int layersCount;
 
@@ -0,0 +1,81 @@
+#include <cstdio>
+#include "test.h"
+
+// Trains a network with batchnorm after a conv & a dense layer on the CPU plan, so the running statistics & gamma/beta
+// move away from the identity, then folds the norms with foldNormalization and checks that the plain network left
+// computes the same logits in inference mode as the normalized one did.
+
+const int BATCH = 16;
+const int STEPS = 200;
+const float TOLERANCE = 1e-4f;  // Relative to the largest logit
+
+int main(){
+    layerGraph graph;
+    graphInput(graph, {2, 6, 6});
+    graphConv(graph, 3, 3, 1, 1);
+    graphNorm(graph);
+    graphActivation(graph, ACT_SOFTPLUS);
+    graphPool(graph, NODE_MAXPOOL, 2, 2);
+    graphDense(graph, 16);
+    graphNorm(graph);
+    graphActivation(graph, ACT_SOFTPLUS);
+    graphDense(graph, 3);
+    graphLoss(graph);
+
+    networkLayout layout;
+    executionPlan plan;
+    planStorage storage;
+    networkBuffers buffers;
+    if(!check(buildNetwork(graph, layout, plan, storage, BATCH, buffers), "the test network has to lower"))
+        return _failures;
+
+    // Inputs off center & scaled, so the running statistics end up far from mean 0 & variance 1
+    dataset data;
+    data.nFeatures = layout.inputNeurons;
+    data.nSamples = 64;
+    data.features.resize(data.nSamples * data.nFeatures);
+    rngFillNormal(data.features.data(), (int64_t)data.features.size(), 1.5f, 3.f, TEST_SEED, RNG_DEBUG, 0);
+    for(int s=0; s < data.nSamples; s++)
+        data.labels.push_back(s % 3);
+
+    tape recording;
+    for(int step=0; step < STEPS; step++)
+        trainStep(plan, layout, buffers, storage, recording, data, BATCH, step, 0.01f);
+
+    float drift = 0.f;
+    for(const forwardingLayer& layer: layout.layers){
+        int channels = (layer.norm.end - layer.norm.begin) / 4;
+        for(int c=0; c < channels; c++)
+            drift += std::fabs(buffers.norms[layer.norm.begin + 2 * channels + c]) + std::fabs(buffers.norms[layer.norm.begin + 3 * channels + c] - 1.f);
+    }
+    check(drift > 0.1f, "training has to move the running statistics, or folding them checks nothing");
+
+    const int logitsBegin = layout.layers.back().neurons.begin, nLogits = layout.layers.back().dstNeurons;
+    sampleBatch(data, buffers, storage, BATCH, layout.nNeurons, STEPS);
+    planForward(plan, layout, buffers, BATCH, false, TEST_SEED, 0);
+    std::vector<float> normalized;
+    for(int b=0; b < BATCH; b++)
+        normalized.insert(normalized.end(), buffers.neurons + b * layout.nNeurons + logitsBegin,
+                          buffers.neurons + b * layout.nNeurons + logitsBegin + nLogits);
+
+    check(foldNormalization(graph, layout, buffers) == 2, "both norm nodes have to be folded");
+    check(layout.nNormParams == 0, "the folded layout has no batchnorm parameters left");
+    for(const graphNode& node: graph.nodes)
+        check(node.type != NODE_NORM, "the folded graph has no norm node left");
+    compilePlan(graph, layout, plan);
+    buffers = allocatePlanBuffers(layout, BATCH, storage, true);
+    planSyncWeights(layout, plan, buffers.weights);
+
+    sampleBatch(data, buffers, storage, BATCH, layout.nNeurons, STEPS);
+    planForward(plan, layout, buffers, BATCH, false, TEST_SEED, 0);
+    float largest = 0.f, maxDifference = 0.f;
+    for(int b=0; b < BATCH; b++)
+        for(int j=0; j < nLogits; j++){
+            float folded = buffers.neurons[b * layout.nNeurons + layout.layers.back().neurons.begin + j];
+            largest = std::fmax(largest, std::fabs(normalized[b * nLogits + j]));
+            maxDifference = std::fmax(maxDifference, std::fabs(folded - normalized[b * nLogits + j]));
+        }
+    printf("Batchnorm folding: logits within %g of the normalized network's (largest %g)\n", maxDifference, largest);
+    check(maxDifference <= TOLERANCE * std::fmax(1.f, largest), "the folded network has to compute the normalized one's logits");
+    return _failures;
+}
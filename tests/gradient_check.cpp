@@ -0,0 +1,98 @@
+#include <cstdio>
+#include "test.h"
+
+// Checks the gradients of the autodiff tape (planForward recording, planBackward replaying) against central
+// finite differences of the batch's loss, on a network with every kind of op: conv, batchnorm, softplus,
+// max pool, dense & dropout. The gradients are sums over the batch, so they are compared to the summed loss.
+
+const int BATCH = 4;
+const float EPSILON = 3e-3f;   // Step of the finite differences, small enough that no max pool window changes its maximum
+const float TOLERANCE = 2e-2f; // Relative
+
+/// Utility function to get the summed loss of the batch, with the same dropout masks & batch statistics as the recorded pass
+float batchLoss(const executionPlan& plan, const networkLayout& layout, const networkBuffers& buffers){
+    return BATCH * planForward(plan, layout, buffers, BATCH, true, TEST_SEED, 0);
+}
+
+/// Compares every parameter of a buffer to its finite difference
+/// returns - the number of mismatches
+int checkParameters(const char* name, float* parameters, const float* gradients, int begin, int end,
+                    const executionPlan& plan, const networkLayout& layout, const networkBuffers& buffers){
+    int mismatches = 0;
+    for(int i=begin; i < end; i++){
+        float value = parameters[i];
+        parameters[i] = value + EPSILON;
+        float plus = batchLoss(plan, layout, buffers);
+        parameters[i] = value - EPSILON;
+        float minus = batchLoss(plan, layout, buffers);
+        parameters[i] = value;
+
+        float numeric = (plus - minus) / (2.f * EPSILON);
+        float analytic = gradients[i];
+        if(std::fabs(numeric - analytic) > TOLERANCE * std::fmax(1.f, std::fabs(numeric) + std::fabs(analytic))){
+            if(mismatches++ < 5)
+                printf("  %s[%d]: tape %f, finite difference %f\n", name, i, analytic, numeric);
+        }
+    }
+    return mismatches;
+}
+
+int main(){
+    // An empty tape replays nothing
+    tape empty;
+    tapeBackward(empty);
+    check(empty.last == nullptr && empty.size == 0, "a default constructed tape has to be empty");
+
+    layerGraph graph;
+    graphInput(graph, {2, 6, 6});
+    graphConv(graph, 3, 3, 1, 1);
+    graphNorm(graph);
+    graphActivation(graph, ACT_SOFTPLUS);
+    graphPool(graph, NODE_MAXPOOL, 2, 2);
+    graphDense(graph, 8);
+    graphActivation(graph, ACT_SOFTPLUS);
+    graphDropout(graph, 0.25f);
+    graphDense(graph, 3);
+    graphLoss(graph);
+
+    networkLayout layout;
+    executionPlan plan;
+    planStorage storage;
+    networkBuffers buffers;
+    if(!check(buildNetwork(graph, layout, plan, storage, BATCH, buffers), "the test network has to lower"))
+        return _failures;
+    // Non-trivial gamma & beta, so their gradients are not a special case
+    for(const forwardingLayer& layer: layout.layers){
+        int channels = (layer.norm.end - layer.norm.begin) / 4;
+        for(int c=0; c < channels; c++){
+            buffers.norms[layer.norm.begin + c] = 1.f + 0.1f * c;
+            buffers.norms[layer.norm.begin + channels + c] = 0.05f * c;
+        }
+    }
+
+    int stride = layout.nNeurons;
+    for(int b=0; b < BATCH; b++){
+        rngFillNormal(buffers.neurons + b * stride, layout.inputNeurons, 0.f, 1.f, TEST_SEED, RNG_DEBUG, b);
+        storage.targets[b] = b % 3;
+    }
+
+    tape recording;
+    planForward(plan, layout, buffers, BATCH, true, TEST_SEED, 0, &recording);
+    check(recording.size > 0, "a training forward pass has to record its ops");
+    planBackward(plan, layout, buffers, recording);
+    check(recording.last == nullptr && recording.size == 0, "planBackward has to reset the tape");
+
+    int mismatches = checkParameters("weights", buffers.weights, buffers.weightGradients, 0, layout.nWeights, plan, layout, buffers);
+    mismatches += checkParameters("biases", buffers.biases, buffers.biasGradients, 0, layout.nBiases, plan, layout, buffers);
+    for(const forwardingLayer& layer: layout.layers){
+        int channels = (layer.norm.end - layer.norm.begin) / 4;
+        mismatches += checkParameters("gamma & beta", buffers.norms, buffers.normGradients, layer.norm.begin,
+                                      layer.norm.begin + 2 * channels, plan, layout, buffers);
+    }
+    check(mismatches == 0, "the tape's gradients have to match the finite differences");
+    printf("Gradient check: %d parameters, %d mismatches\n", layout.nWeights + layout.nBiases + layout.nNormParams / 2, mismatches);
+
+    tapeFree(recording);
+    check(recording.memory.blocks.empty(), "tapeFree has to return the arena's blocks");
+    return _failures;
+}
@@ -0,0 +1,113 @@
+#include <cstdio>
+#include "test.h"
+
+// Checks the 16 bit weight storage of the CPU plan: the bf16 & fp16 conversions round to nearest even, a plan
+// compiled for each precision computes the fp32 plan's logits on the same weights within the storage's rounding,
+// keeps its accuracy, and still trains on the fp32 master weights.
+
+const int BATCH = 16;
+const int STEPS = 4000;
+const float LEARNING_RATE = 0.05f;
+// Largest logit difference to fp32, relative to max(1, |logit|). A weight is rounded by at most 2^-8 (bf16) or
+// 2^-11 (fp16) of itself, through two hidden layers that grows to a few times as much on the logits.
+const float BF16_TOLERANCE = 5e-2f;
+const float FP16_TOLERANCE = 5e-3f;
+const float MAX_ACCURACY_LOSS = 0.02f;  // 3 iris samples
+
+/// Checks the rounding of both conversions on values whose result is known
+void checkConversions(){
+    check(toFloat(toBf16(1.f)) == 1.f && toFloat(toFp16(1.f)) == 1.f, "1 has to be exact in both formats");
+    check(toFloat(toBf16(-2.5f)) == -2.5f && toFloat(toFp16(-2.5f)) == -2.5f, "-2.5 has to be exact in both formats");
+    // Halfway between two bf16 values (1 + 2^-8), ties to the even mantissa 1.0, 1 + 3 * 2^-8 goes up to 1 + 2^-6
+    check(toFloat(toBf16(1.f + 1.f / 256.f)) == 1.f, "bf16 has to round ties to even (down)");
+    check(toFloat(toBf16(1.f + 3.f / 256.f)) == 1.f + 1.f / 64.f, "bf16 has to round ties to even (up)");
+    check(toFloat(toFp16(1.f + 1.f / 2048.f)) == 1.f, "fp16 has to round ties to even (down)");
+    check(toFloat(toFp16(1.f + 3.f / 2048.f)) == 1.f + 1.f / 512.f, "fp16 has to round ties to even (up)");
+    check(toFloat(toFp16(65504.f)) == 65504.f, "the largest half has to be exact");
+    check(std::isinf(toFloat(toFp16(70000.f))), "fp16 has to overflow to infinity");
+    check(toFloat(toFp16(std::ldexp(1.f, -24))) == std::ldexp(1.f, -24), "the smallest half subnormal has to be exact");
+    check(std::isnan(toFloat(toBf16(NAN))) && std::isnan(toFloat(toFp16(NAN))), "NaNs have to stay NaNs");
+    check(std::fabs(toFloat(toBf16(1e30f)) / 1e30f - 1.f) <= 1.f / 256.f, "bf16 has to keep fp32's exponent range");
+
+    // Relative error of random weight sized values against half an ulp (8 & 11 significant bits)
+    std::vector<float> values(1 << 16);
+    rngFillNormal(values.data(), (int64_t)values.size(), 0.f, 1.f, TEST_SEED, RNG_DEBUG, 0);
+    float bf16Error = 0.f, fp16Error = 0.f;
+    for(float v: values){
+        if(std::fabs(v) < 1e-4f) continue;  // fp16 subnormals lose relative precision
+        bf16Error = std::fmax(bf16Error, std::fabs(toFloat(toBf16(v)) - v) / std::fabs(v));
+        fp16Error = std::fmax(fp16Error, std::fabs(toFloat(toFp16(v)) - v) / std::fabs(v));
+    }
+    printf("Conversions: relative error up to %g (bf16), %g (fp16)\n", bf16Error, fp16Error);
+    check(bf16Error <= std::ldexp(1.f, -8), "bf16 has to round to the nearest value");
+    check(fp16Error <= std::ldexp(1.f, -11), "fp16 has to round to the nearest value");
+}
+
+int main(){
+    checkConversions();
+
+    dataset data;
+    if(!check(loadDataset(IRIS_PATH, 4, data), "iris has to load (run from the repository's root)"))
+        return _failures;
+
+    // fp32 reference
+    layerGraph graph;
+    irisGraph(graph, {16, 16});
+    networkLayout layout;
+    executionPlan plan;
+    planStorage storage;
+    networkBuffers buffers;
+    if(!check(buildNetwork(graph, layout, plan, storage, BATCH, buffers), "the iris network has to lower"))
+        return _failures;
+    tape recording;
+    for(int step=0; step < STEPS; step++)
+        trainStep(plan, layout, buffers, storage, recording, data, BATCH, step, LEARNING_RATE);
+    float fp32Accuracy = planAccuracy(plan, layout, buffers, data);
+    check(fp32Accuracy >= 0.9f, "the fp32 network has to learn iris");
+
+    const forwardingLayer& logits = layout.layers.back();
+    sampleBatch(data, buffers, storage, BATCH, layout.nNeurons, STEPS);
+    std::vector<float> batchInputs(buffers.neurons, buffers.neurons + BATCH * layout.nNeurons);
+    planForward(plan, layout, buffers, BATCH, false, TEST_SEED, 0);
+    std::vector<float> reference(buffers.neurons, buffers.neurons + BATCH * layout.nNeurons);
+
+    const precision precisions[] = {PRECISION_BF16, PRECISION_FP16};
+    const float tolerances[] = {BF16_TOLERANCE, FP16_TOLERANCE};
+    for(int p=0; p < 2; p++){
+        // The same weights, read from 16 bit storage
+        executionPlan halfPlan;
+        compilePlan(graph, layout, halfPlan, precisions[p]);
+        planSyncWeights(layout, halfPlan, buffers.weights);
+        std::copy(batchInputs.begin(), batchInputs.end(), buffers.neurons);
+        planForward(halfPlan, layout, buffers, BATCH, false, TEST_SEED, 0);
+        float worst = 0.f;
+        for(int b=0; b < BATCH; b++)
+            for(int j=logits.neurons.begin; j < logits.neurons.end; j++){
+                float expected = reference[b * layout.nNeurons + j];
+                worst = std::fmax(worst, std::fabs(buffers.neurons[b * layout.nNeurons + j] - expected) / std::fmax(1.f, std::fabs(expected)));
+            }
+        float accuracy = planAccuracy(halfPlan, layout, buffers, data);
+        printf("%s weights: logits within %g of fp32, accuracy %.1f%% (fp32 %.1f%%)\n", PRECISION_NAMES[precisions[p]], worst,
+               100.f * accuracy, 100.f * fp32Accuracy);
+        check(worst <= tolerances[p], "16 bit weights have to give the fp32 logits within the storage's rounding");
+        check(accuracy >= fp32Accuracy - MAX_ACCURACY_LOSS, "16 bit weights lost too much accuracy");
+
+        // Trained from scratch with the 16 bit forward pass, the gradients & updates stay fp32
+        layerGraph trainedGraph;
+        irisGraph(trainedGraph, {16, 16});
+        networkLayout trainedLayout;
+        executionPlan trainedPlan;
+        planStorage trainedStorage;
+        networkBuffers trainedBuffers;
+        buildNetwork(trainedGraph, trainedLayout, trainedPlan, trainedStorage, BATCH, trainedBuffers);
+        compilePlan(trainedGraph, trainedLayout, trainedPlan, precisions[p]);
+        planSyncWeights(trainedLayout, trainedPlan, trainedBuffers.weights);
+        tape trainedRecording;
+        for(int step=0; step < STEPS; step++)
+            trainStep(trainedPlan, trainedLayout, trainedBuffers, trainedStorage, trainedRecording, data, BATCH, step, LEARNING_RATE);
+        float trainedAccuracy = planAccuracy(trainedPlan, trainedLayout, trainedBuffers, data);
+        printf("%s training: accuracy %.1f%%\n", PRECISION_NAMES[precisions[p]], 100.f * trainedAccuracy);
+        check(trainedAccuracy >= 0.9f, "a network trained with 16 bit forward weights has to learn iris");
+    }
+    return _failures;
+}
@@ -0,0 +1,45 @@
+#include <cstdio>
+#include "test.h"
+#include "nn/lowrank.h"
+
+// Trains a dense network on iris with the CPU plan, factorizes it with lowRankFactorize & checks the accuracy
+// the factorization costs. At RANK only the 32 x 32 hidden layer saves work, the thin input & output layers stay.
+
+const int BATCH = 16;
+const int STEPS = 4000;
+const float LEARNING_RATE = 0.05f;
+const int RANK = 12;
+const float MAX_ACCURACY_LOSS = 0.05f;  // The factorized network may lose at most this much accuracy
+
+int main(){
+    dataset data;
+    if(!check(loadDataset(IRIS_PATH, 4, data), "iris has to load (run from the repository's root)"))
+        return _failures;
+
+    layerGraph graph;
+    irisGraph(graph, {32, 32});
+    networkLayout layout;
+    executionPlan plan;
+    planStorage storage;
+    networkBuffers buffers;
+    if(!check(buildNetwork(graph, layout, plan, storage, BATCH, buffers), "the iris network has to lower"))
+        return _failures;
+
+    tape recording;
+    for(int step=0; step < STEPS; step++)
+        trainStep(plan, layout, buffers, storage, recording, data, BATCH, step, LEARNING_RATE);
+    float before = planAccuracy(plan, layout, buffers, data);
+    check(before >= 0.9f, "the network has to learn iris");
+
+    int layersBefore = (int)layout.layers.size(), weightsBefore = layout.nWeights;
+    int factorized = lowRankFactorize(graph, layout, plan, storage, data, RANK, 0.f);
+    check(factorized == 1, "only the 32 x 32 layer saves work at this rank");
+    check((int)layout.layers.size() == layersBefore + factorized, "each factorized layer has to become two");
+    check(layout.nWeights == weightsBefore - 32 * 32 + RANK * (32 + 32), "the factorized layer has to hold rank * (src + dst) weights");
+
+    buffers = allocatePlanBuffers(layout, 1, storage, true);
+    float after = planAccuracy(plan, layout, buffers, data);
+    printf("Rank %d: accuracy %.1f%% -> %.1f%%, %d -> %d weights\n", RANK, 100.f * before, 100.f * after, weightsBefore, layout.nWeights);
+    check(after >= before - MAX_ACCURACY_LOSS, "the factorization lost too much accuracy");
+    return _failures;
+}
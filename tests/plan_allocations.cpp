@@ -0,0 +1,74 @@
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include "test.h"
+#include "nn/sparse.h"
+
+// Checks that training steps on the CPU plan (planForward recording a tape, planBackward replaying it) never touch
+// the heap once the first step has grown the tape's arena. Every op kind runs: conv, batchnorm, softplus, max pool,
+// dense, a dense layer on the sparse kernels & its prune mask, dropout.
+
+const int BATCH = 16;
+const int STEPS = 100;
+
+// Counts every heap allocation of the program
+static size_t _allocations = 0;
+void* operator new(size_t size){
+    _allocations++;
+    if(void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+int main(){
+    layerGraph graph;
+    graphInput(graph, {2, 6, 6});
+    graphConv(graph, 3, 3, 1, 1);
+    graphNorm(graph);
+    graphActivation(graph, ACT_SOFTPLUS);
+    graphPool(graph, NODE_MAXPOOL, 2, 2);
+    graphDense(graph, 32);
+    graphActivation(graph, ACT_SOFTPLUS);
+    graphDropout(graph, 0.25f);
+    graphDense(graph, 16);
+    graphNorm(graph);
+    graphActivation(graph, ACT_SOFTPLUS);
+    graphDense(graph, 3);
+    graphLoss(graph);
+
+    networkLayout layout;
+    executionPlan plan;
+    planStorage storage;
+    networkBuffers buffers;
+    if(!check(buildNetwork(graph, layout, plan, storage, BATCH, buffers), "the test network has to lower"))
+        return _failures;
+    // The 32 -> 16 layer runs sparse, the prune mask is applied after every step
+    planPrune(layout, plan, buffers.weights, 3, 0.9f);
+    check(planSparsify(layout, plan, buffers.weights) == 1, "the pruned layer has to switch to the sparse kernels");
+
+    // Random samples, any data does for counting allocations
+    dataset data;
+    data.nFeatures = layout.inputNeurons;
+    data.nSamples = 64;
+    data.features.resize(data.nSamples * data.nFeatures);
+    rngFillNormal(data.features.data(), (int64_t)data.features.size(), 0.f, 1.f, TEST_SEED, RNG_DEBUG, 0);
+    for(int s=0; s < data.nSamples; s++)
+        data.labels.push_back(s % 3);
+
+    tape recording;
+    size_t before = _allocations;
+    trainStep(plan, layout, buffers, storage, recording, data, BATCH, 0, 0.01f);
+    check(_allocations > before, "the first step has to grow the tape's arena, or the counter sees nothing");
+    before = _allocations;
+    float loss = 0.f;
+    for(int step=1; step <= STEPS; step++)
+        loss = trainStep(plan, layout, buffers, storage, recording, data, BATCH, step, 0.01f);
+    size_t allocations = _allocations - before;
+
+    printf("Plan allocations: %zu over %d steps after the first, last loss %f\n", allocations, STEPS, loss);
+    check(allocations == 0, "training steps after the first must not allocate");
+    check(std::isfinite(loss), "the loss has to stay finite");
+    return _failures;
+}
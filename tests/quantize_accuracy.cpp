@@ -0,0 +1,55 @@
+#include <cstdio>
+#include "test.h"
+#include "nn/quantize.h"
+
+// Trains a dense network on iris with the CPU plan, folds its batchnorm, quantizes it to int8 & reports the accuracy
+// of the integer engine against the fp32 network. Build with -mavx2 (plus -mavxvnni or -mavx512vnni -mavx512vl) to check the
+// SIMD dot products, the scalar fallback runs otherwise.
+
+const int BATCH = 16;
+const int STEPS = 4000;
+const float LEARNING_RATE = 0.05f;
+const float MAX_ACCURACY_LOSS = 0.05f;  // int8 may lose at most this much accuracy against fp32
+
+int main(){
+    dataset data;
+    if(!check(loadDataset(IRIS_PATH, 4, data), "iris has to load (run from the repository's root)"))
+        return _failures;
+
+    layerGraph graph;
+    graphInput(graph, {4, 1, 1});
+    graphDense(graph, 16);
+    graphNorm(graph);
+    graphActivation(graph, ACT_SOFTPLUS);
+    graphDense(graph, 16);
+    graphActivation(graph, ACT_SOFTPLUS);
+    graphDense(graph, 3);
+    graphLoss(graph);
+    networkLayout layout;
+    executionPlan plan;
+    planStorage storage;
+    networkBuffers buffers;
+    if(!check(buildNetwork(graph, layout, plan, storage, BATCH, buffers), "the iris network has to lower"))
+        return _failures;
+
+    tape recording;
+    for(int step=0; step < STEPS; step++)
+        trainStep(plan, layout, buffers, storage, recording, data, BATCH, step, LEARNING_RATE);
+    float fp32Accuracy = planAccuracy(plan, layout, buffers, data);
+    check(fp32Accuracy >= 0.9f, "the fp32 network has to learn iris");
+
+    // The integer engine has no normalization, it goes into the weights first
+    check(foldNormalization(graph, layout, buffers) == 1, "the norm node has to be folded");
+    compilePlan(graph, layout, plan);
+    buffers = allocatePlanBuffers(layout, BATCH, storage, true);
+    planSyncWeights(layout, plan, buffers.weights);
+    float foldedAccuracy = planAccuracy(plan, layout, buffers, data);
+    check(std::fabs(foldedAccuracy - fp32Accuracy) <= 1.f / data.nSamples, "folding the batchnorm must not change the predictions");
+
+    quantizedNetwork network;
+    if(!check(quantizeNetwork(plan, layout, buffers, data, data.nSamples, network), "a dense network has to quantize"))
+        return _failures;
+    float int8Accuracy = reportQuantization(plan, layout, buffers, network, data);
+    check(int8Accuracy >= fp32Accuracy - MAX_ACCURACY_LOSS, "int8 lost too much accuracy against fp32");
+    return _failures;
+}
@@ -0,0 +1,51 @@
+#include <cstdio>
+#include <numeric>
+#include <algorithm>
+#include "test.h"
+
+// Checks the epoch shuffle of nn/rng.h, the one main.cpp uploads for the device dataset: every epoch is a permutation
+// of the samples, the same (seed, epoch) always gives the same one, & every element lands on every position about
+// equally often.
+
+const int SAMPLES = 60000;     // MNIST sized
+const int SMALL = 4;           // Elements of the uniformity check
+const int SHUFFLES = 24000;    // Of the small array
+const float MAX_BIAS = 0.05f;  // Relative deviation from the expected count allowed per position
+
+int main(){
+    std::vector<int> first(SAMPLES), again(SAMPLES), next(SAMPLES), sorted(SAMPLES);
+    std::iota(first.begin(), first.end(), 0);
+    again = next = first;
+    rngShuffle(first.data(), SAMPLES, TEST_SEED, 0);
+    rngShuffle(again.data(), SAMPLES, TEST_SEED, 0);
+    rngShuffle(next.data(), SAMPLES, TEST_SEED, 1);
+
+    sorted = first;
+    std::sort(sorted.begin(), sorted.end());
+    bool permutation = true;
+    for(int i=0; i < SAMPLES; i++)
+        permutation &= sorted[i] == i;
+    check(permutation, "an epoch has to hold every sample exactly once");
+    check(first == again, "the same seed & epoch have to give the same order");
+    check(first != next, "consecutive epochs have to be shuffled differently");
+    int fixed = 0;
+    for(int i=0; i < SAMPLES; i++)
+        fixed += first[i] == i;
+    check(fixed < 10, "a shuffled epoch can't leave many samples in place");
+
+    // Position of element 0 over many small shuffles, a biased Fisher-Yates (e.g. j drawn from all of [0, n)) shows here
+    int counts[SMALL] = {};
+    for(int s=0; s < SHUFFLES; s++){
+        int indices[SMALL];
+        std::iota(indices, indices + SMALL, 0);
+        rngShuffle(indices, SMALL, TEST_SEED, (uint32_t)s);
+        counts[std::find(indices, indices + SMALL, 0) - indices]++;
+    }
+    float worst = 0.f;
+    for(int p=0; p < SMALL; p++)
+        worst = std::fmax(worst, std::fabs(counts[p] * (float)SMALL / SHUFFLES - 1.f));
+    printf("Shuffle of %d samples: %d left in place, positions of a small shuffle within %.1f%% of uniform\n",
+           SAMPLES, fixed, 100.f * worst);
+    check(worst < MAX_BIAS, "every position has to be about equally likely");
+    return _failures;
+}
@@ -0,0 +1,59 @@
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "test.h"
+
+// Checks that the bulk fills of nn/rng.h give bit-identical buffers whatever the number of threads & however a buffer
+// is sliced: the same fills run on 1 thread & on several, then against the scalar generator one value at a time.
+// Build with -fopenmp, the thread counts can't be compared otherwise.
+
+const int64_t LENGTH = (1 << 20) + 37;  // Large enough to be split across threads, not a whole number of chunks
+const uint64_t OFFSET = 3;              // Starts mid-block
+
+/// Utility function to fill one buffer of every kind
+void fillAll(std::vector<uint32_t>& words, std::vector<float>& uniform, std::vector<float>& normal){
+    rngFillUint(words.data(), LENGTH, TEST_SEED, RNG_DEBUG, 1, OFFSET);
+    rngFillUniform(uniform.data(), LENGTH, -2.f, 3.f, TEST_SEED, RNG_DEBUG, 2, OFFSET);
+    rngFillNormal(normal.data(), LENGTH, 0.5f, 2.f, TEST_SEED, RNG_DEBUG, 3, OFFSET);
+}
+
+template<class T>
+bool bitIdentical(const std::vector<T>& a, const std::vector<T>& b){
+    return std::memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0;
+}
+
+int main(){
+    std::vector<uint32_t> words(LENGTH), wordsThreaded(LENGTH);
+    std::vector<float> uniform(LENGTH), uniformThreaded(LENGTH), normal(LENGTH), normalThreaded(LENGTH);
+
+#ifdef _OPENMP
+    int threads = omp_get_max_threads() > 4 ? omp_get_max_threads() : 4;
+    omp_set_num_threads(1);
+    fillAll(words, uniform, normal);
+    omp_set_num_threads(threads);
+    fillAll(wordsThreaded, uniformThreaded, normalThreaded);
+    printf("RNG fills of %lld values: 1 thread against %d\n", (long long)LENGTH, threads);
+    check(bitIdentical(words, wordsThreaded), "rngFillUint has to give the same words on any number of threads");
+    check(bitIdentical(uniform, uniformThreaded), "rngFillUniform has to give the same floats on any number of threads");
+    check(bitIdentical(normal, normalThreaded), "rngFillNormal has to give the same floats on any number of threads");
+#else
+    fillAll(words, uniform, normal);
+    check(false, "build with -fopenmp to compare the fills across thread counts");
+#endif
+
+    // Every value against the scalar generator
+    bool scalar = true;
+    for(int64_t i=0; i < LENGTH; i++){
+        scalar &= words[i] == rngUint(TEST_SEED, RNG_DEBUG, 1, OFFSET + i);
+        scalar &= uniform[i] == -2.f + rngUniform(TEST_SEED, RNG_DEBUG, 2, OFFSET + i) * 5.f;
+    }
+    check(scalar, "the bulk fills have to match rngUint & rngUniform value for value");
+
+    // Uneven slices filled one after the other, each with its own offset
+    const int64_t cuts[] = {0, 1, 30, 4097, 70001, LENGTH};
+    std::fill(normalThreaded.begin(), normalThreaded.end(), 0.f);
+    for(int c=0; c + 1 < (int)(sizeof(cuts) / sizeof(cuts[0])); c++)
+        rngFillNormal(normalThreaded.data() + cuts[c], cuts[c + 1] - cuts[c], 0.5f, 2.f, TEST_SEED, RNG_DEBUG, 3, OFFSET + cuts[c]);
+    check(bitIdentical(normal, normalThreaded), "a buffer filled in slices has to match the one filled at once");
+    return _failures;
+}
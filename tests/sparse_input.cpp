@@ -0,0 +1,79 @@
+#include <cstdio>
+#include "test.h"
+
+// Checks that planSparsifyInput only turns the sparse input kernel on for data that is mostly 0: never for iris,
+// whose features are all nonzero, but for a synthetic dataset with 10% nonzero features, where the kernel has to
+// compute the logits of the dense one.
+
+const int BATCH = 16;
+const int FEATURES = 64;
+const float NONZERO = 0.1f;     // Fraction of the synthetic features that are not 0
+const float TOLERANCE = 1e-5f;  // Relative to the largest logit, only the order of the sums differs
+
+/// Utility function to check whether any op of the plan runs the sparse input kernel
+bool readsSparseInput(const executionPlan& plan){
+    for(const planOp& op: plan.ops)
+        if(op.sparseInput) return true;
+    return false;
+}
+
+int main(){
+    dataset iris;
+    if(!check(loadDataset(IRIS_PATH, 4, iris), "iris has to load (run from the repository's root)"))
+        return _failures;
+    layerGraph graph;
+    irisGraph(graph, {16});
+    networkLayout layout;
+    executionPlan plan;
+    planStorage storage;
+    networkBuffers buffers;
+    if(!check(buildNetwork(graph, layout, plan, storage, BATCH, buffers), "the iris network has to lower"))
+        return _failures;
+    check(!readsSparseInput(plan), "a compiled plan has to start on the dense kernels");
+    float irisDensity = planSparsifyInput(layout, plan, iris);
+    printf("Iris input density %.3f\n", irisDensity);
+    check(!readsSparseInput(plan), "iris is dense, it must not run the sparse input kernel");
+
+    // Mostly 0 features
+    dataset data;
+    data.nFeatures = FEATURES;
+    data.nSamples = 256;
+    data.features.resize(data.nSamples * data.nFeatures);
+    rngFillNormal(data.features.data(), (int64_t)data.features.size(), 0.f, 1.f, TEST_SEED, RNG_DEBUG, 0);
+    for(int64_t i=0; i < (int64_t)data.features.size(); i++)
+        if(rngUniform(TEST_SEED, RNG_DEBUG, 1, i) >= NONZERO)
+            data.features[i] = 0.f;
+    for(int s=0; s < data.nSamples; s++)
+        data.labels.push_back(s % 3);
+
+    layerGraph sparseGraph;
+    graphInput(sparseGraph, {FEATURES, 1, 1});
+    graphDense(sparseGraph, 32);
+    graphActivation(sparseGraph, ACT_SOFTPLUS);
+    graphDense(sparseGraph, 3);
+    graphLoss(sparseGraph);
+    if(!check(buildNetwork(sparseGraph, layout, plan, storage, BATCH, buffers), "the sparse input network has to lower"))
+        return _failures;
+    sampleBatch(data, buffers, storage, BATCH, layout.nNeurons, 0);
+    std::vector<float> batchInputs(buffers.neurons, buffers.neurons + BATCH * layout.nNeurons);
+    planForward(plan, layout, buffers, BATCH, false, TEST_SEED, 0);
+    std::vector<float> dense(buffers.neurons, buffers.neurons + BATCH * layout.nNeurons);
+
+    float density = planSparsifyInput(layout, plan, data);
+    printf("Synthetic input density %.3f\n", density);
+    check(std::fabs(density - NONZERO) < 0.02f, "the measured density has to be the generated one");
+    check(plan.ops[0].sparseInput && !plan.ops[1].sparseInput, "only the layer reading the sparse input has to use its kernel");
+
+    std::copy(batchInputs.begin(), batchInputs.end(), buffers.neurons);
+    planForward(plan, layout, buffers, BATCH, false, TEST_SEED, 0);
+    const forwardingLayer& logits = layout.layers.back();
+    float largest = 0.f, maxDifference = 0.f;
+    for(int b=0; b < BATCH; b++)
+        for(int j=logits.neurons.begin; j < logits.neurons.end; j++){
+            largest = std::fmax(largest, std::fabs(dense[b * layout.nNeurons + j]));
+            maxDifference = std::fmax(maxDifference, std::fabs(buffers.neurons[b * layout.nNeurons + j] - dense[b * layout.nNeurons + j]));
+        }
+    printf("Sparse input kernel: logits within %g of the dense kernel's (largest %g)\n", maxDifference, largest);
+    check(maxDifference <= TOLERANCE * std::fmax(1.f, largest), "the sparse input kernel has to compute the dense kernel's logits");
+    return _failures;
+}
@@ -0,0 +1,101 @@
+#include <cstdio>
+#include "test.h"
+#include "nn/sparse.h"
+
+// Gradual magnitude pruning while training on iris with the CPU plan: every PRUNE_EVERY steps of the ramp the hidden
+// layers are pruned to gradualSparsity's target, then planSparsify switches each layer to the kernels its measured
+// density calls for. Checks the final density, the switch to the sparse kernels, that pruned weights stay 0 while
+// training goes on, that the sparse kernels compute what the dense ones do, and that the network still learns.
+// Then prunes a trained network to MASKED_SPARSITY, too dense for the sparse kernels, and checks that the prune mask
+// keeps the density unchanged while the dense kernels train on.
+
+const int BATCH = 16;
+const int STEPS = 6000;
+const int PRUNE_BEGIN = 1000, PRUNE_END = 4000, PRUNE_EVERY = 100;
+const float FINAL_SPARSITY = 0.9f;
+const float MASKED_SPARSITY = 0.5f;
+const int MASKED_STEPS = 500;  // Training steps after pruning to MASKED_SPARSITY
+const float LEARNING_RATE = 0.05f;
+
+int main(){
+    dataset data;
+    if(!check(loadDataset(IRIS_PATH, 4, data), "iris has to load (run from the repository's root)"))
+        return _failures;
+
+    layerGraph graph;
+    irisGraph(graph, {64, 64});
+    networkLayout layout;
+    executionPlan plan;
+    planStorage storage;
+    networkBuffers buffers;
+    if(!check(buildNetwork(graph, layout, plan, storage, BATCH, buffers), "the iris network has to lower"))
+        return _failures;
+    const int nPruned = (int)layout.layers.size() - 1;  // Every layer but the logits
+
+    tape recording;
+    int sparseLayers = 0;
+    bool sparseBeforeThreshold = false;
+    for(int step=0; step < STEPS; step++){
+        if(step > PRUNE_BEGIN && step <= PRUNE_END && step % PRUNE_EVERY == 0){
+            float sparsity = gradualSparsity(step, PRUNE_BEGIN, PRUNE_END, FINAL_SPARSITY);
+            for(int i=0; i < nPruned; i++)
+                planPrune(layout, plan, buffers.weights, i, sparsity);
+            sparseLayers = planSparsify(layout, plan, buffers.weights);
+            sparseBeforeThreshold |= sparseLayers > 0 && 1.f - sparsity > SPARSE_DENSITY_THRESHOLD;
+        }
+        trainStep(plan, layout, buffers, storage, recording, data, BATCH, step, LEARNING_RATE);
+    }
+
+    check(!sparseBeforeThreshold, "layers denser than SPARSE_DENSITY_THRESHOLD have to stay on the dense kernels");
+    check(sparseLayers == nPruned, "every pruned layer has to end up on the sparse kernels");
+    for(int i=0; i < nPruned; i++){
+        float density = weightDensity(layout.layers[i], buffers.weights);
+        printf("Layer %d: density %.3f, %s kernels\n", i, density, plan.ops[i].sparse ? "sparse" : "dense");
+        check(std::fabs(density - (1.f - FINAL_SPARSITY)) < 0.02f, "pruned weights have to stay 0 while training goes on");
+    }
+
+    // The sparse kernels against the dense ones on the same weights
+    executionPlan densePlan = plan;
+    for(planOp& op: densePlan.ops)
+        op.sparse = false;
+    const forwardingLayer& logits = layout.layers.back();
+    sampleBatch(data, buffers, storage, BATCH, layout.nNeurons, STEPS);
+    planForward(plan, layout, buffers, BATCH, false, TEST_SEED, 0);
+    std::vector<float> sparseLogits(buffers.neurons, buffers.neurons + BATCH * layout.nNeurons);
+    planForward(densePlan, layout, buffers, BATCH, false, TEST_SEED, 0);
+    float maxDifference = 0.f;
+    for(int b=0; b < BATCH; b++)
+        for(int j=logits.neurons.begin; j < logits.neurons.end; j++)
+            maxDifference = std::fmax(maxDifference, std::fabs(sparseLogits[b * layout.nNeurons + j] - buffers.neurons[b * layout.nNeurons + j]));
+    check(maxDifference < 1e-4f, "the sparse kernels have to match the dense ones");
+
+    float accuracy = planAccuracy(plan, layout, buffers, data);
+    printf("Sparsity %.0f%%: accuracy %.1f%%, sparse vs dense logits within %g\n", 100.f * FINAL_SPARSITY, 100.f * accuracy, maxDifference);
+    check(accuracy >= 0.9f, "the pruned network has to keep learning iris");
+
+    // Pruned once to a density the dense kernels keep running, only the prune mask holds the pruned weights at 0
+    layerGraph maskedGraph;
+    irisGraph(maskedGraph, {64, 64});
+    networkLayout maskedLayout;
+    executionPlan maskedPlan;
+    planStorage maskedStorage;
+    networkBuffers maskedBuffers;
+    buildNetwork(maskedGraph, maskedLayout, maskedPlan, maskedStorage, BATCH, maskedBuffers);
+    tape maskedRecording;
+    for(int step=0; step < PRUNE_BEGIN; step++)
+        trainStep(maskedPlan, maskedLayout, maskedBuffers, maskedStorage, maskedRecording, data, BATCH, step, LEARNING_RATE);
+    std::vector<float> pruned(nPruned);
+    for(int i=0; i < nPruned; i++){
+        planPrune(maskedLayout, maskedPlan, maskedBuffers.weights, i, MASKED_SPARSITY);
+        pruned[i] = weightDensity(maskedLayout.layers[i], maskedBuffers.weights);
+    }
+    check(planSparsify(maskedLayout, maskedPlan, maskedBuffers.weights) == 0, "layers pruned to MASKED_SPARSITY have to stay dense");
+    for(int step=PRUNE_BEGIN; step < PRUNE_BEGIN + MASKED_STEPS; step++)
+        trainStep(maskedPlan, maskedLayout, maskedBuffers, maskedStorage, maskedRecording, data, BATCH, step, LEARNING_RATE);
+    for(int i=0; i < nPruned; i++){
+        float density = weightDensity(maskedLayout.layers[i], maskedBuffers.weights);
+        printf("Masked layer %d: density %.3f after pruning, %.3f after %d steps on the dense kernels\n", i, pruned[i], density, MASKED_STEPS);
+        check(density == pruned[i], "the prune mask has to keep pruned weights at 0 on the dense kernels");
+    }
+    return _failures;
+}
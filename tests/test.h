@@ -0,0 +1,105 @@
+#pragma once
+#include <cmath>
+#include <iostream>
+#include <vector>
+#include "nn/graph.h"
+#include "nn/plan.h"
+#include "nn/dataset.h"
+#include "nn/rng.h"
+
+// Shared setup of the CPU tests, every test is a standalone program over the header-only nn/ code
+// Run them from the repository's root so the datasets are found, a failed check prints an ERROR:: line
+// and the test's exit code is the number of failed checks.
+
+const char* IRIS_PATH = "./data/iris/iris.data";
+const uint64_t TEST_SEED = 7;
+
+static int _failures = 0;
+
+/// Records a check, printing what failed
+/// returns - ok
+inline bool check(bool ok, const char* what){
+    if(!ok){
+        std::cerr << "ERROR::TEST_FAILED\n" << what << std::endl;
+        _failures++;
+    }
+    return ok;
+}
+
+/// Lowers a graph & compiles its plan, with the parameters initialized like main.cpp does
+/// (He for the softplus layers, Xavier for the others, batchnorm to the identity)
+/// batch - samples the storage is sized for
+/// buffers - output, views of the storage
+/// returns - false if the graph cannot be lowered
+inline bool buildNetwork(layerGraph& graph, networkLayout& layout, executionPlan& plan, planStorage& storage, int batch,
+                         networkBuffers& buffers){
+    optimizeGraph(graph);
+    if(!lowerGraph(graph, layout))
+        return false;
+    compilePlan(graph, layout, plan);
+    buffers = allocatePlanBuffers(layout, batch, storage);
+    for(int i=0; i < (int)layout.layers.size(); i++){
+        const forwardingLayer& layer = layout.layers[i];
+        int fanIn = layer.type == LAYER_CONV ? layer.src.channels * layer.kernel * layer.kernel : layer.srcNeurons;
+        if(layer.weights.end == layer.weights.begin)
+            continue;
+        if(layer.activation == ACT_SOFTPLUS)
+            heInit(buffers.weights + layer.weights.begin, fanIn, layer.dst.channels, TEST_SEED, i);
+        else
+            xavierInit(buffers.weights + layer.weights.begin, fanIn, layer.dst.channels, TEST_SEED, i);
+        if(layer.norm.end > layer.norm.begin)
+            batchNormInit(buffers.norms + layer.norm.begin, layer.dst.channels);
+    }
+    planSyncWeights(layout, plan, buffers.weights);
+    return true;
+}
+
+/// Dense network over iris: softplus hidden layers & the loss
+/// hidden - neurons of each hidden layer
+inline void irisGraph(layerGraph& graph, const std::vector<int>& hidden){
+    graphInput(graph, {4, 1, 1});
+    for(int neurons: hidden){
+        graphDense(graph, neurons);
+        graphActivation(graph, ACT_SOFTPLUS);
+    }
+    graphDense(graph, 3);
+    graphLoss(graph);
+}
+
+/// Fills a batch with random rows of the dataset, drawn like the host path of main.cpp
+inline void sampleBatch(const dataset& data, const networkBuffers& buffers, planStorage& storage, int batch, int stride, uint64_t step){
+    for(int b=0; b < batch; b++){
+        int sample = (int)(((uint64_t)rngUint(TEST_SEED, RNG_SAMPLE, 0, step * batch + b) * data.nSamples) >> 32);
+        std::copy_n(data.features.data() + sample * data.nFeatures, data.nFeatures, buffers.neurons + b * stride);
+        storage.targets[b] = data.labels[sample];
+    }
+}
+
+/// One SGD step of the plan over a batch, the gradients averaged over the batch like optimizer.comp
+/// Allocates nothing once the tape's arena has grown to the step's size.
+/// returns - the batch's mean loss
+inline float trainStep(executionPlan& plan, const networkLayout& layout, const networkBuffers& buffers, planStorage& storage,
+                       tape& recording, const dataset& data, int batch, uint64_t step, float learningRate){
+    sampleBatch(data, buffers, storage, batch, layout.nNeurons, step);
+    std::fill(storage.weightGradients.begin(), storage.weightGradients.end(), 0.f);
+    std::fill(storage.biasGradients.begin(), storage.biasGradients.end(), 0.f);
+    std::fill(storage.normGradients.begin(), storage.normGradients.end(), 0.f);
+
+    float loss = planForward(plan, layout, buffers, batch, true, TEST_SEED, step * batch, &recording);
+    planBackward(plan, layout, buffers, recording);
+
+    float scale = learningRate / batch;
+    for(int i=0; i < layout.nWeights; i++)
+        buffers.weights[i] -= scale * buffers.weightGradients[i];
+    for(int i=0; i < layout.nBiases; i++)
+        buffers.biases[i] -= scale * buffers.biasGradients[i];
+    // Gamma & beta only, the running statistics are the forward pass's
+    for(const forwardingLayer& layer: layout.layers){
+        int channels = (layer.norm.end - layer.norm.begin) / 4;
+        for(int i=layer.norm.begin; i < layer.norm.begin + 2 * channels; i++)
+            buffers.norms[i] -= scale * buffers.normGradients[i];
+    }
+    planApplyPruneMask(layout, plan, buffers.weights);
+    planSyncWeights(layout, plan, buffers.weights);
+    return loss;
+}